@@ -12,6 +12,12 @@
 #include <queue>
 #include <QDebug>
 #include <set>
+#include <numeric>
+#include <functional>
+#include <fstream>
+#include <iterator>
+#include <cstring>
+#include <type_traits>
 
 std::minstd_rand rand_engine; // Reasonably quick pseudo-random generator
 
@@ -27,6 +33,91 @@ Type random_in_range(Type start, Type end)
 }
 
 
+//Empties a container and gives back its memory, which clear would keep.
+template <typename Container>
+void release(Container& c)
+{
+    Container().swap(c);
+}
+
+//Bytes a vector holds outside of itself.
+template <typename Vector>
+std::size_t vector_bytes(Vector const& v)
+{
+    return v.capacity()*sizeof(typename Vector::value_type);
+}
+
+//Bytes a string holds outside of itself, none if the text fits in the string object.
+std::size_t string_bytes(std::string const& s)
+{
+    if (s.capacity() <= std::string().capacity()) {return 0;}
+    return s.capacity()+1;
+}
+
+//A snapshot file starts with SNAPSHOT_MAGIC, the format version, the size of the payload
+//and the 64-bit FNV-1a hash of the payload, followed by the payload itself. The values are
+//stored as they are in memory, so a snapshot is only read back on the same kind of machine.
+char const SNAPSHOT_MAGIC[8] = {'P', 'R', 'G', '2', 'S', 'N', 'A', 'P'};
+std::uint32_t const SNAPSHOT_VERSION = 2;
+
+std::uint64_t snapshot_hash(std::string_view bytes)
+{
+    std::uint64_t hash = 14695981039346656037ull;
+    for (char c : bytes) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+//Appends values to the payload of a snapshot.
+struct SnapshotWriter {
+    std::string bytes;
+
+    template <typename Type>
+    void put(Type const& value) {
+        static_assert(std::is_trivially_copyable_v<Type>);
+        bytes.append(reinterpret_cast<char const*>(&value), sizeof(Type));
+    }
+    //The size and then the elements.
+    template <typename Vector>
+    void put_vector(Vector const& v) {
+        static_assert(std::is_trivially_copyable_v<typename Vector::value_type>);
+        put<std::uint64_t>(v.size());
+        bytes.append(reinterpret_cast<char const*>(v.data()), v.size()*sizeof(typename Vector::value_type));
+    }
+    void put_string(std::string_view s) {
+        put<std::uint64_t>(s.size());
+        bytes.append(s);
+    }
+};
+
+//Reads the values of a payload back in the order they were put. The checksum has been
+//checked, so the reads aren't.
+struct SnapshotReader {
+    char const* pos;
+
+    template <typename Type>
+    Type get() {
+        Type value;
+        std::memcpy(&value, pos, sizeof(Type));
+        pos += sizeof(Type);
+        return value;
+    }
+    template <typename Vector>
+    void get_vector(Vector& v) {
+        v.resize(get<std::uint64_t>());
+        std::memcpy(v.data(), pos, v.size()*sizeof(typename Vector::value_type));
+        pos += v.size()*sizeof(typename Vector::value_type);
+    }
+    std::string get_string() {
+        auto size = get<std::uint64_t>();
+        std::string s(pos, size);
+        pos += size;
+        return s;
+    }
+};
+
 Datastructures::Datastructures()
 {
     // Replace this comment with your implementation
@@ -39,226 +130,390 @@ Datastructures::~Datastructures()
 
 int Datastructures::stop_count()
 {
-    return stops.size();
+    return stop_ids.size();
 }
 
 std::vector<StopID> Datastructures::all_stops()
 {
-    std::vector<StopID> s;
-
-    for (auto it=stops.begin(); it!=stops.end(); it++) {
-        s.push_back(it->first);
-    }
-
-    return s;
+    return stop_ids;
 }
 
-bool Datastructures::add_stop(StopID id, const Name& name, Coord xy)
+StopIdx Datastructures::find_stop(StopID id)
 {
-    if (stops.find(id) != stops.end()) {return false;}
-
-    Stop new_stop;
-    new_stop.id = id;
-    new_stop.name = name;
-    new_stop.location = xy;
-    new_stop.parent = NO_REGION;
-
-    stops.insert(std::pair<StopID, Stop>(id, new_stop));
+    auto it = stop_index.find(id);
+    if (it == stop_index.end()) {return NO_INDEX;}
+    return it->second;
+}
 
-    unsorted_alph.push_back(id);
-    unsorted_coord.push_back(id);
 
+bool Datastructures::add_stop(StopID id, const Name& name, Coord xy)
+{
+    //The new stop gets the next free index at the end of the stop vectors.
+    StopIdx idx = stop_ids.size();
+    if (!stop_index.insert(std::pair<StopID, StopIdx>(id, idx)).second) {return false;}
+
+    stop_ids.push_back(id);
+    stop_names.push_back(intern_name(name));
+    stop_coords.push_back(xy);
+    stop_parents.push_back(NO_INDEX);
+    stop_region_pos.push_back(NO_INDEX);
+    stop_routes_out.emplace_back(&route_memory);
+    stop_routes_in.emplace_back(&route_memory);
+    stop_route_lists.emplace_back(&route_memory);
+
+    alph_order.insert({stop_names[idx], id}); //O(log(n))
+    alph_stale = true;
+    if (name_grams_built) {add_name_grams(name, id);}
+    coord_order.insert(coord_key(idx)); //O(log(n))
+    coord_stale = true;
+
+    //New stops wait in kd_extra until the next rebuild of the k-d tree.
+    kd_pos.push_back(NO_INDEX);
+    kd_extra_pos.push_back(kd_extra.size());
+    kd_extra.push_back(idx);
+
+    csr_stale = true;
+    walks_stale = true;
+    timetable_stale = true;
     return true;
 }
 
-Name Datastructures::get_stop_name(StopID id)
+std::string_view Datastructures::name_text(NameIdx handle) const
 {
-    if (stops.find(id) == stops.end()) {return NO_NAME;}
-    return stops[id].name;
+    return std::string_view(name_chars).substr(name_offsets[handle], name_offsets[handle+1]-name_offsets[handle]);
 }
 
-Coord Datastructures::get_stop_coord(StopID id)
+NameIdx Datastructures::find_name(std::string_view name)
 {
-    if (stops.find(id) == stops.end()) {return NO_COORD;}
-    return stops[id].location;
+    if (name_table.empty()) {return NO_INDEX;}
+    std::size_t mask = name_table.size()-1;
+    for (std::size_t slot = std::hash<std::string_view>()(name) & mask; name_table[slot] != NO_INDEX; slot = (slot+1) & mask) { //O(1) average
+        if (name_text(name_table[slot]) == name) {return name_table[slot];}
+    }
+    return NO_INDEX;
 }
 
-std::vector<StopID> Datastructures::stops_alphabetically()
+NameIdx Datastructures::intern_name(Name const& name)
 {
-    auto compare_alph = [&](StopID i, StopID j)-> bool {
-        return (stops[i].name < stops[j].name);
-    };
+    NameIdx handle = find_name(name);
+    if (handle != NO_INDEX) {
+        if (name_uses[handle]++ == 0) {names_unused--;}
+        return handle;
+    }
 
-    if (flag_alph == true || sorted_alph.size() == 0) {
-        //Sort from scratch
-        std::vector<StopID> temp;
+    handle = name_offsets.size()-1;
+    name_chars += name;
+    name_offsets.push_back(name_chars.size());
+    name_uses.push_back(1);
 
-        for (auto it=stops.begin(); it!=stops.end(); it++) { //O(n)
-            temp.push_back(it->first);
-        }
+    //Double the table when it would get more than half full, and put every name in again.
+    if (2*(handle+1) > name_table.size()) {
+        name_table.assign(std::max<std::size_t>(16, 2*name_table.size()), NO_INDEX);
+        for (NameIdx h=0; h<handle; h++) {place_name(h);}
+    }
+    place_name(handle);
+    return handle;
+}
 
-        std::sort(temp.begin(), temp.end(), compare_alph); //O(nlog(n))
+void Datastructures::place_name(NameIdx handle)
+{
+    std::size_t mask = name_table.size()-1;
+    std::size_t slot = std::hash<std::string_view>()(name_text(handle)) & mask;
+    while (name_table[slot] != NO_INDEX) {slot = (slot+1) & mask;}
+    name_table[slot] = handle;
+}
 
-        sorted_alph = temp;
-        unsorted_alph.clear();
-        flag_alph = false;
+void Datastructures::drop_name(NameIdx handle)
+{
+    if (--name_uses[handle] > 0) {return;}
+    names_unused++;
+    //Every unused name was left by a rename or a removal, so a compaction once there are more
+    //of them than stops costs O(1) amortized for each.
+    if (names_unused > stop_ids.size()) {compact_names();}
+}
 
-        return sorted_alph;
+void Datastructures::compact_names()
+{
+    std::vector<NameIdx> renamed(name_uses.size(), NO_INDEX);
+    std::string chars;
+    std::vector<std::uint32_t> offsets = {0};
+    std::vector<std::uint32_t> uses;
+    for (NameIdx h=0; h<name_uses.size(); h++) {
+        if (name_uses[h] == 0) {continue;}
+        renamed[h] = uses.size();
+        chars += name_text(h);
+        offsets.push_back(chars.size());
+        uses.push_back(name_uses[h]);
     }
+    name_chars.swap(chars);
+    name_offsets.swap(offsets);
+    name_uses.swap(uses);
+    names_unused = 0;
+
+    std::size_t slots = 16;
+    while (slots < 2*name_uses.size()) {slots *= 2;}
+    name_table.assign(slots, NO_INDEX);
+    for (NameIdx h=0; h<name_uses.size(); h++) {place_name(h);}
+
+    for (NameIdx& handle : stop_names) {handle = renamed[handle];}
+    //The renumbering keeps the order, so the keys go back in order, each in O(1).
+    std::vector<NameKey> keys;
+    keys.reserve(alph_order.size());
+    for (NameKey const& key : alph_order) {keys.emplace_back(renamed[key.first], key.second);}
+    alph_order.clear();
+    for (NameKey const& key : keys) {alph_order.emplace_hint(alph_order.end(), key);}
+}
 
-    if (unsorted_alph.size() > 0) {
-        //Sort the unsorted part and merge it with the sorted one.
-        std::vector<StopID> sorted(sorted_alph.size()+unsorted_alph.size());
+Name Datastructures::get_stop_name(StopID id)
+{
+    StopIdx idx = find_stop(id);
+    if (idx == NO_INDEX) {return NO_NAME;}
+    return Name(stop_name(idx));
+}
 
-        //That will be mlog(m) where m is the unsorted vector size.
-        std::sort(unsorted_alph.begin(), unsorted_alph.end(), compare_alph);
+Coord Datastructures::get_stop_coord(StopID id)
+{
+    StopIdx idx = find_stop(id);
+    if (idx == NO_INDEX) {return NO_COORD;}
+    return stop_coords[idx];
+}
 
-        //Merging operation is O(1+n-m) where n is the sorted vector size and m is the unsorted vector size.
-        std::merge(sorted_alph.begin(), sorted_alph.end(), unsorted_alph.begin(), unsorted_alph.end(), sorted.begin(), compare_alph);
-        sorted_alph = sorted;
-        unsorted_alph.clear();
+std::vector<StopID> const& Datastructures::stops_alphabetically()
+{
+    //The set is always in order, so only copy it out if it has changed since the last call.
+    if (alph_stale) {
+        alph_ids.clear();
+        for (auto &pair : alph_order) {alph_ids.push_back(pair.second);} //O(n)
+        alph_stale = false;
     }
-
-    //Otherwise, if everything has been sorted previously, just return the sorted_alph vector
-    return sorted_alph;
+    return alph_ids;
 }
 
 
-//Exactly the same as the pervious function, but with different comparison criteria.
-std::vector<StopID> Datastructures::stops_coord_order()
+//The same as the previous function, but in coordinate order.
+std::vector<StopID> const& Datastructures::stops_coord_order()
 {
-    auto compare_coord = [&](StopID i, StopID j)-> bool {
-        Stop s1 = stops[i]; Stop s2 = stops[j];
-        long int dist1 = pow(s1.location.x, 2) + pow(s1.location.y, 2);
-        long int dist2 = pow(s2.location.x, 2) + pow(s2.location.y, 2);
-        //Handle the case when distances are the same.
-        if (dist1 == dist2) {return s1.location.y < s2.location.y;}
-        return (dist1 < dist2);
-    };
+    if (coord_stale) {
+        coord_ids.clear();
+        for (auto &key : coord_order) {coord_ids.push_back(std::get<2>(key));} //O(n)
+        coord_stale = false;
+    }
+    return coord_ids;
+}
+
+StopID Datastructures::min_coord()
+{
+    //The first and the last stop in the coordinate order. O(1)
+    if (coord_order.empty()) {return NO_STOP;}
+    return std::get<2>(*coord_order.begin());
+}
 
-    if (flag_coord == true || sorted_coord.size() == 0) {
-        //Sort from scratch
-        std::vector<StopID> temp;
+StopID Datastructures::max_coord()
+{
+    if (coord_order.empty()) {return NO_STOP;}
+    return std::get<2>(*coord_order.rbegin());
+}
 
-        for (auto it=stops.begin(); it!=stops.end(); it++) { //O(n)
-            temp.push_back(it->first);
-        }
+std::vector<StopID> Datastructures::find_stops(Name const& name)
+{
+    //The stops with the name are next to each other in the alphabetical order, and they all
+    //point to the same interned text. O(log(n)+k)
+    std::vector<StopID> matches;
+    NameIdx handle = find_name(name);
+    if (handle == NO_INDEX) {return matches;}
+    for (auto it = alph_order.lower_bound({handle, std::numeric_limits<StopID>::min()}); it != alph_order.end() && it->first == handle; it++) {
+        matches.push_back(it->second);
+    }
+    return matches;
+}
 
-        std::sort(temp.begin(), temp.end(), compare_coord); //O(nlog(n))
+std::vector<StopID> Datastructures::find_stops_prefix(Name const& prefix)
+{
+    //So are the stops whose names start with the prefix. O(log(n)+k)
+    std::vector<StopID> matches;
+    for (auto it = alph_order.lower_bound(std::string_view(prefix)); it != alph_order.end(); it++) {
+        if (name_text(it->first).compare(0, prefix.size(), prefix) != 0) {break;}
+        matches.push_back(it->second);
+    }
+    return matches;
+}
 
-        sorted_coord = temp;
-        unsorted_coord.clear();
-        flag_coord = false;
+std::vector<StopID> Datastructures::find_stops_substring(Name const& part)
+{
+    std::vector<StopID> matches;
 
-        return sorted_coord;
+    //Without a whole trigram to look up, every name has to be checked. O(n)
+    if (part.size() < 3) {
+        for (auto &pair : alph_order) {
+            if (name_text(pair.first).find(part) != std::string_view::npos) {matches.push_back(pair.second);}
+        }
+        return matches;
     }
 
-    if (unsorted_coord.size() > 0) {
-        //Merge
-        std::vector<StopID> sorted(sorted_coord.size()+unsorted_coord.size());
+    if (!name_grams_built) {build_name_grams();}
 
-        std::sort(unsorted_coord.begin(), unsorted_coord.end(), compare_coord);
+    //Every match is on the list of each trigram of the part, so check the names on the shortest one.
+    std::vector<StopID> const* shortest = nullptr;
+    for (std::uint32_t key : name_gram_keys(part)) {
+        auto it = name_grams.find(key);
+        if (it == name_grams.end()) {return matches;}
+        if (shortest == nullptr || it->second.size() < shortest->size()) {shortest = &it->second;}
+    }
 
-        std::merge(sorted_coord.begin(), sorted_coord.end(), unsorted_coord.begin(), unsorted_coord.end(), sorted.begin(), compare_coord);
-        sorted_coord = sorted;
-        unsorted_coord.clear();
+    std::vector<StopIdx> found;
+    for (StopID id : *shortest) { //O(k), k is the length of the list
+        StopIdx idx = find_stop(id);
+        if (idx != NO_INDEX && stop_name(idx).find(part) != std::string_view::npos) {found.push_back(idx);}
     }
 
-    //Otherwise, just return the sorted_coord vector
-    return sorted_coord;
+    //A renamed stop may be on the list more than once. The matches come in alphabetical order.
+    auto compare_alph = [this](StopIdx i, StopIdx j) {
+        return NameOrder{this}(NameKey(stop_names[i], stop_ids[i]), NameKey(stop_names[j], stop_ids[j]));
+    };
+    std::sort(found.begin(), found.end(), compare_alph); //O(mlog(m)), m is the number of matches
+    found.erase(std::unique(found.begin(), found.end()), found.end());
+    for (StopIdx idx : found) {matches.push_back(stop_ids[idx]);}
+    return matches;
 }
 
-StopID Datastructures::min_coord()
+std::vector<std::uint32_t> Datastructures::name_gram_keys(std::string_view name)
 {
-    if (stop_count() == 0) {return NO_STOP;}
-
-    int long min_dist = std::numeric_limits<int>::max();
-    int long min_id = -1;
-
-    for (auto it=stops.begin(); it!=stops.end(); it++) {
-        int long dist = pow(it->second.location.x, 2) + pow(it->second.location.y, 2);
-        if (dist < min_dist) {min_dist = dist; min_id = it->first;}
-
-        //Handle the case when distances are the same
-        if (dist == min_dist) {
-            if (it->second.location.y < stops[min_id].location.y) {
-                min_dist = dist; min_id = it->first;
-            }
-        }
+    //Each trigram packed into an integer, every distinct one once.
+    std::vector<std::uint32_t> keys;
+    for (std::size_t i=0; i+3<=name.size(); i++) {
+        keys.push_back(static_cast<unsigned char>(name[i]) << 16 | static_cast<unsigned char>(name[i+1]) << 8 | static_cast<unsigned char>(name[i+2]));
     }
-    return min_id;
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    return keys;
 }
 
-StopID Datastructures::max_coord()
+void Datastructures::build_name_grams()
 {
-    if (stop_count() == 0) {return NO_STOP;}
-
-    int long max_dist = -1;
-    int long max_id = -1;
-
-    for (auto it=stops.begin(); it!=stops.end(); it++) {
-        int long dist = pow(it->second.location.x, 2) + pow(it->second.location.y, 2);
-        if (dist > max_dist) {max_dist = dist; max_id = it->first;}
+    name_grams.clear();
+    name_grams_total = 0;
+    name_grams_stale = 0;
+    for (StopIdx i=0; i<stop_ids.size(); i++) {add_name_grams(stop_name(i), stop_ids[i]);} //O(n*l), l is the length of a name
+    name_grams_built = true;
+}
 
-        //Handle the case when distances are the same
-        if (dist == max_dist) {
-            if (it->second.location.y > stops[max_id].location.y) {
-                max_dist = dist; max_id = it->first;
-            }
-        }
+void Datastructures::add_name_grams(std::string_view name, StopID id)
+{
+    for (std::uint32_t key : name_gram_keys(name)) {
+        name_grams[key].push_back(id);
+        name_grams_total++;
     }
-    return max_id;
 }
 
-std::vector<StopID> Datastructures::find_stops(Name const& name)
+void Datastructures::drop_name_grams(std::string_view name)
 {
-    //Basic linear search O(n)
-    std::vector<StopID> matches;
-    for (auto it=stops.begin(); it!=stops.end(); it++) {
-        if (it->second.name == name) {matches.push_back(it->first);}
+    //The IDs stay on the lists. Once most of the entries are stale, the next search rebuilds the index.
+    name_grams_stale += name_gram_keys(name).size();
+    if (2*name_grams_stale > name_grams_total) {
+        name_grams.clear();
+        name_grams_built = false;
     }
-    return matches;
 }
 
 bool Datastructures::change_stop_name(StopID id, const Name& newname)
 {
-    if (stops.find(id) == stops.end()) {return false;}
-    stops[id].name = newname;
-    flag_alph = true;
+    StopIdx idx = find_stop(id);
+    if (idx == NO_INDEX) {return false;}
+    //Reposition the stop in the alphabetical order. O(log(n))
+    alph_order.erase({stop_names[idx], id});
+    if (name_grams_built) {
+        drop_name_grams(stop_name(idx));
+        if (name_grams_built) {add_name_grams(newname, id);}
+    }
+    NameIdx oldname = stop_names[idx];
+    stop_names[idx] = intern_name(newname);
+    alph_order.insert({stop_names[idx], id});
+    alph_stale = true;
+    drop_name(oldname);
     return true;
 }
 
 bool Datastructures::change_stop_coord(StopID id, Coord newcoord)
 {
-    if (stops.find(id) == stops.end()) {return false;}
-    stops[id].location = newcoord;
-    flag_coord = true;
+    StopIdx idx = find_stop(id);
+    if (idx == NO_INDEX) {return false;}
+    //Reposition the stop in the coordinate order. O(log(n))
+    coord_order.erase(coord_key(idx));
+    if (stop_parents[idx] != NO_INDEX) {
+        region_drop_point(stop_parents[idx], stop_coords[idx]); //O(k)
+        region_add_point(stop_parents[idx], newcoord); //O(k)
+    }
+    stop_coords[idx] = newcoord;
+    coord_order.insert(coord_key(idx));
+    coord_stale = true;
+
+    //The tree entry of a moved stop is left dead and the stop waits in kd_extra.
+    if (kd_pos[idx] != NO_INDEX) {
+        kd_points[kd_pos[idx]].stop = NO_INDEX;
+        kd_dead++;
+        kd_pos[idx] = NO_INDEX;
+        kd_extra_pos[idx] = kd_extra.size();
+        kd_extra.push_back(idx);
+    }
+
+    //Recompute the lengths of the route edges touching the stop, in the CSR too if it's built.
+    for (auto &pair : stop_routes_out[idx]) {
+        Distance length = calc_dist(idx, pair.second.stop);
+        pair.second.length = length;
+        find_edge(stop_routes_in[pair.second.stop], pair.first, idx)->length = length;
+        set_csr_length(idx, pair.first, length);
+    }
+    for (auto &pair : stop_routes_in[idx]) {
+        Distance length = calc_dist(pair.second.stop, idx);
+        pair.second.length = length;
+        find_edge(stop_routes_out[pair.second.stop], pair.first)->length = length;
+        set_csr_length(pair.second.stop, pair.first, length);
+    }
+    walks_stale = true;
+
     return true;
 }
 
 bool Datastructures::add_region(RegionID id, const Name &name)
 {
+    auto ret = region_index.insert(std::pair<RegionID, RegionIdx>(id, regions.size()));
+    if (!ret.second) {return false;}
+
     Region new_region;
     new_region.id = id;
     new_region.name = name;
-    new_region.parent = NO_REGION;
+    regions.push_back(new_region);
 
-    auto ret = regions.insert(std::pair<RegionID, Region>(id, new_region));
-    return ret.second;
+    //A new region is the root of a tree of its own.
+    region_parents.push_back(NO_INDEX);
+    region_depth.push_back(0);
+    if (region_lca_built) {
+        for (auto &level : region_up) {level.push_back(regions.size()-1);}
+    }
+    return true;
+}
+
+RegionIdx Datastructures::find_region(RegionID id)
+{
+    auto it = region_index.find(id);
+    if (it == region_index.end()) {return NO_INDEX;}
+    return it->second;
 }
 
 Name Datastructures::get_region_name(RegionID id)
 {
-    if (regions.find(id) == regions.end()) {return NO_NAME;}
-    return regions[id].name;
+    RegionIdx region = find_region(id);
+    if (region == NO_INDEX) {return NO_NAME;}
+    return regions[region].name;
 }
 
 std::vector<RegionID> Datastructures::all_regions()
 {
     std::vector<RegionID> r;
+    r.reserve(regions.size());
 
     for (auto it=regions.begin(); it!=regions.end(); it++) {
-        r.push_back(it->first);
+        r.push_back(it->id);
     }
 
     return r;
@@ -266,261 +521,947 @@ std::vector<RegionID> Datastructures::all_regions()
 
 bool Datastructures::add_stop_to_region(StopID id, RegionID parentid)
 {
-    if (stops.find(id) == stops.end()) {return false;}
-    if (regions.find(parentid) == regions.end()) {return false;}
-    if (stops[id].parent != NO_REGION) {return false;}
-
-    stops[id].parent = parentid; //O(1) average
-    regions[parentid].region_stops.push_back(id); //O(1) amortized
+    StopIdx idx = find_stop(id);
+    if (idx == NO_INDEX) {return false;}
+    RegionIdx parent = find_region(parentid);
+    if (parent == NO_INDEX) {return false;}
+    if (stop_parents[idx] != NO_INDEX) {return false;}
+
+    stop_parents[idx] = parent; //O(1)
+    stop_region_pos[idx] = regions[parent].region_stops.size();
+    regions[parent].region_stops.push_back(id); //O(1) amortized
+    region_add_point(parent, stop_coords[idx]); //O(k)
     return true;
 }
 
 bool Datastructures::add_subregion_to_region(RegionID id, RegionID parentid)
 {
-    if (regions.find(id) == regions.end()) {return false;}
-    if (regions.find(parentid) == regions.end()) {return false;}
-    if (regions[id].parent != NO_REGION) {return false;}
+    RegionIdx region = find_region(id);
+    if (region == NO_INDEX) {return false;}
+    RegionIdx parent = find_region(parentid);
+    if (parent == NO_INDEX) {return false;}
+    if (region_parents[region] != NO_INDEX) {return false;}
+    //A region can't become a subregion of itself or of its own subregion.
+    if (region_lca_built) {
+        if (common_region(region, parent) == region) {return false;} //O(log(k))
+    }
+    else {
+        RegionIdx r = parent;
+        while (region_depth[r] > region_depth[region]) {r = region_parents[r];} //O(k)
+        if (r == region) {return false;}
+    }
 
-    regions[id].parent = parentid; //O(1) average
-    regions[parentid].children.push_back(id); //O(1) amortized
+    region_parents[region] = parent; //O(1)
+    regions[parent].children.push_back(region); //O(1) amortized
+
+    //Add the stops of the subregion to the boxes and counts of its new superregions.
+    Region const& sub = regions[region];
+    if (sub.stop_count != 0) {
+        for (RegionIdx r=parent; r!=NO_INDEX; r=region_parents[r]) { //O(k)
+            Region& reg = regions[r];
+            if (reg.stop_count == 0) {
+                reg.box_min = sub.box_min; reg.box_max = sub.box_max;
+                reg.box_stale = sub.box_stale;
+            }
+            else if (sub.box_stale) {reg.box_stale = true;}
+            else if (!reg.box_stale) {
+                reg.box_min = {std::min(reg.box_min.x, sub.box_min.x), std::min(reg.box_min.y, sub.box_min.y)};
+                reg.box_max = {std::max(reg.box_max.x, sub.box_max.x), std::max(reg.box_max.y, sub.box_max.y)};
+            }
+            reg.stop_count += sub.stop_count;
+        }
+    }
+    update_region_depths(region); //O(s), s is the size of the subtree
     return true;
 }
 
 std::vector<RegionID> Datastructures::stop_regions(StopID id)
 {
-    if (stops.find(id) == stops.end()) {return {NO_REGION};}
+    StopIdx idx = find_stop(id);
+    if (idx == NO_INDEX) {return {NO_REGION};}
 
-    std::vector<RegionID> r;
-    RegionID current_region = stops[id].parent;
+    //A stop without a region has no regions to return.
+    RegionIdx region = stop_parents[idx];
+    if (region == NO_INDEX) {return {};}
 
-    while (true) {
-        r.push_back(current_region); //O(1) amortized
-        current_region = regions[current_region].parent; //O(1) average
-        if (current_region == NO_REGION) {break;}
+    std::vector<RegionID> r;
+    r.reserve(region_depth[region]+1);
+    for (; region!=NO_INDEX; region=region_parents[region]) { //O(k)
+        r.push_back(regions[region].id); //O(1)
     }
     return r;
 }
 
 void Datastructures::creation_finished()
 {
+    build_csr();
+    build_timetable();
+    build_kd_tree();
+    build_region_lca();
 }
 
-void Datastructures::get_region_subregions(RegionID id, std::vector<RegionID>& v) { //O(k)
-    //Get all the subregions within a region.
-    std::vector<RegionID> sub = regions[id].children;
-
-    for (auto it=sub.begin(); it!=sub.end(); it++) { //O(k), k is number of regions
-       v.push_back(*it);
-       get_region_subregions(*it, v);
+void Datastructures::region_add_point(RegionIdx region, Coord xy)
+{
+    for (RegionIdx r=region; r!=NO_INDEX; r=region_parents[r]) { //O(k)
+        Region& reg = regions[r];
+        if (reg.stop_count == 0) {
+            reg.box_min = xy; reg.box_max = xy;
+            reg.box_stale = false;
+        }
+        //A stale box is only known to contain the stops, so it stays stale.
+        else if (!reg.box_stale) {
+            reg.box_min = {std::min(reg.box_min.x, xy.x), std::min(reg.box_min.y, xy.y)};
+            reg.box_max = {std::max(reg.box_max.x, xy.x), std::max(reg.box_max.y, xy.y)};
+        }
+        reg.stop_count++;
     }
 }
 
-std::list<StopID> Datastructures::get_all_region_stops(RegionID id) { //O(k*m) ~= O(n)
-    //Get all the stops contained within a region directly or indirectly (i.e. within its subregions).
-    std::vector<RegionID> sub = {id};
-    get_region_subregions(id, sub); //O(k)
-
-    std::list<StopID> all_region_stops;
-
-    for (auto it=sub.begin(); it!=sub.end(); it++) { //O(k)
-        std::vector<StopID> current_stops = regions[*it].region_stops;
-        //O(m) where m is the average number of stops per region
-        all_region_stops.insert(all_region_stops.end(), current_stops.begin(), current_stops.end());
+void Datastructures::region_drop_point(RegionIdx region, Coord xy)
+{
+    for (RegionIdx r=region; r!=NO_INDEX; r=region_parents[r]) { //O(k)
+        Region& reg = regions[r];
+        reg.stop_count--;
+        //The box can only shrink if the stop was on its edge.
+        if (xy.x == reg.box_min.x || xy.x == reg.box_max.x || xy.y == reg.box_min.y || xy.y == reg.box_max.y) {
+            reg.box_stale = true;
+        }
     }
+}
 
-    return all_region_stops;
+void Datastructures::refresh_region_box(RegionIdx region)
+{
+    //The box is the union of the direct stops and the boxes of the subregions. Only the
+    //subregions that are stale themselves have to be recomputed.
+    Region& reg = regions[region];
+    Coord lo = {std::numeric_limits<int>::max(), std::numeric_limits<int>::max()};
+    Coord hi = {std::numeric_limits<int>::min(), std::numeric_limits<int>::min()};
+    for (StopID stop : reg.region_stops) { //O(m)
+        Coord c = stop_coords[find_stop(stop)];
+        lo = {std::min(lo.x, c.x), std::min(lo.y, c.y)};
+        hi = {std::max(hi.x, c.x), std::max(hi.y, c.y)};
+    }
+    for (RegionIdx child : reg.children) {
+        Region& sub = regions[child];
+        if (sub.stop_count == 0) {continue;}
+        if (sub.box_stale) {refresh_region_box(child);}
+        lo = {std::min(lo.x, sub.box_min.x), std::min(lo.y, sub.box_min.y)};
+        hi = {std::max(hi.x, sub.box_max.x), std::max(hi.y, sub.box_max.y)};
+    }
+    reg.box_min = lo; reg.box_max = hi;
+    reg.box_stale = false;
 }
 
 std::pair<Coord,Coord> Datastructures::region_bounding_box(RegionID id)
 {
-    if (regions.find(id) == regions.end()) {return {NO_COORD, NO_COORD};}
+    RegionIdx region = find_region(id);
+    if (region == NO_INDEX) {return {NO_COORD, NO_COORD};}
+    if (regions[region].stop_count == 0) {return {NO_COORD, NO_COORD};}
 
-    std::list<StopID> all_region_stops = get_all_region_stops(id); //O(n)
-    if (all_region_stops.size() == 0) {return {NO_COORD, NO_COORD};}
+    if (regions[region].box_stale) {refresh_region_box(region);}
+    return {regions[region].box_min, regions[region].box_max}; //O(1) unless a box has shrunk
+}
 
-    long int minx = std::numeric_limits<int>::max();
-    long int miny = std::numeric_limits<int>::max();
-    long int maxx = std::numeric_limits<int>::min();
-    long int maxy = std::numeric_limits<int>::min();
-    Coord max_coord, min_coord;
+std::vector<StopID> Datastructures::stops_closest_to(StopID id)
+{
+    //If no stop with the given ID exists, return nothing.
+    StopIdx idx = find_stop(id);
+    if (idx == NO_INDEX) {return {NO_STOP};}
+
+    return nearest_stops(stop_coords[idx], 5, idx);
+}
+
+std::vector<StopID> Datastructures::stops_nearest_k(Coord xy, unsigned int k)
+{
+    return nearest_stops(xy, k, NO_INDEX);
+}
 
-    for (auto it=all_region_stops.begin(); it!=all_region_stops.end(); it++) { //O(n)
-        long int x = stops[*it].location.x; long int y = stops[*it].location.y;
-        if (x < minx) {minx=x;}
-        if (y < miny) {miny=y;}
-        if (x > maxx) {maxx=x;}
-        if (y > maxy) {maxy=y;}
+std::vector<StopID> Datastructures::stops_within_radius(Coord xy, Distance radius)
+{
+    if (radius < 0) {return {};}
+    refresh_kd_tree();
+
+    std::vector<NearStop> found;
+    long int limit = static_cast<long int>(radius) * radius;
+    kd_within(0, kd_points.size(), false, xy, limit, found); //O(sqrt(n)+m), m is the number of stops found
+    for (StopIdx i : kd_extra) { //O(k), k is the number of stops outside the tree
+        NearStop candidate = near_stop(i, xy);
+        if (std::get<0>(candidate) <= limit) {found.push_back(candidate);}
+    }
+    std::sort(found.begin(), found.end()); //O(mlog(m))
+
+    std::vector<StopID> s;
+    s.reserve(found.size());
+    for (auto &stop : found) {
+        s.push_back(std::get<2>(stop));
     }
-    min_coord.x = minx; min_coord.y = miny;
-    max_coord.x = maxx; max_coord.y = maxy;
-    return {min_coord, max_coord};
+
+    return s;
 }
 
-std::vector<StopID> Datastructures::stops_closest_to(StopID id)
+std::vector<StopID> Datastructures::nearest_stops(Coord xy, std::size_t k, StopIdx skip)
 {
-    //If no stop with the given ID exists, return nothing.
-    if (stops.find(id) == stops.end()) {return {NO_STOP};}
+    if (k == 0) {return {};}
+    refresh_kd_tree();
+
+    //The k closest stops, closest first.
+    std::vector<NearStop> best;
+    kd_nearest(0, kd_points.size(), false, xy, skip, best, k); //O(klog(n)) on average
+    for (StopIdx i : kd_extra) { //O(k), k is the number of stops outside the tree
+        if (i != skip) {kd_offer(near_stop(i, xy), best, k);}
+    }
 
-    //Initialize the return vector.
     std::vector<StopID> s;
+    s.reserve(best.size());
+    for (auto &stop : best) {
+        s.push_back(std::get<2>(stop));
+    }
 
-    //Define the to-be-sorted vector (temp) and the stop coordinates.
-    std::vector<Stop> temp;
-    long int X = stops[id].location.x;
-    long int Y = stops[id].location.y;
+    return s;
+}
 
-    //Add all Stop objects (except the given stop) from the map to the temp vector.
-    for (auto it=stops.begin(); it!=stops.end(); it++) { //O(n)
-        if (it->first != id) {temp.push_back(it->second);}
+Datastructures::NearStop Datastructures::near_stop(StopIdx stop, Coord target)
+{
+    long int dx = static_cast<long int>(stop_coords[stop].x) - target.x;
+    long int dy = static_cast<long int>(stop_coords[stop].y) - target.y;
+    return NearStop(dx*dx + dy*dy, stop_coords[stop].y, stop_ids[stop], stop);
+}
+
+void Datastructures::refresh_kd_tree()
+{
+    //Rebuild the tree when the stops outside it and the dead entries in it start to cost
+    //more than the tree saves.
+    if (kd_extra.size() + kd_dead > 64 + 2*std::sqrt(stop_ids.size())) {build_kd_tree();}
+}
+
+void Datastructures::build_kd_tree()
+{
+    kd_points.clear();
+    kd_points.reserve(stop_ids.size());
+    for (StopIdx i=0; i<stop_ids.size(); i++) {
+        kd_points.push_back({stop_coords[i], i});
     }
+    kd_build(0, kd_points.size(), false); //O(n*log(n))
 
-    //Define the criteria for sorting (i.e. proximity the given stop).
-    auto comp = [&](Stop i, Stop j)-> bool {
-        long int dist1 = pow(i.location.x - X, 2) + pow(i.location.y - Y, 2);
-        long int dist2 = pow(j.location.x - X, 2) + pow(j.location.y - Y, 2);
-        return (dist1 < dist2);
-    };
+    for (std::uint32_t pos=0; pos<kd_points.size(); pos++) {
+        kd_pos[kd_points[pos].stop] = pos;
+    }
+    kd_extra.clear();
+    kd_dead = 0;
+}
+
+void Datastructures::kd_build(std::uint32_t lo, std::uint32_t hi, bool by_y)
+{
+    if (hi - lo <= 1) {return;}
+
+    //The median goes to the middle, the points before it are not after it on the axis and vice versa.
+    std::uint32_t mid = lo + (hi-lo) / 2;
+    std::nth_element(kd_points.begin()+lo, kd_points.begin()+mid, kd_points.begin()+hi, [by_y](KdPoint const& a, KdPoint const& b) {
+        return by_y ? a.xy.y < b.xy.y : a.xy.x < b.xy.x;
+    });
+    kd_build(lo, mid, !by_y);
+    kd_build(mid+1, hi, !by_y);
+}
+
+void Datastructures::kd_nearest(std::uint32_t lo, std::uint32_t hi, bool by_y, Coord xy, StopIdx skip,
+                                std::vector<NearStop>& best, std::size_t k)
+{
+    if (lo >= hi) {return;}
+
+    std::uint32_t mid = lo + (hi-lo) / 2;
+    KdPoint const& point = kd_points[mid];
+    if (point.stop != NO_INDEX && point.stop != skip) {kd_offer(near_stop(point.stop, xy), best, k);}
+
+    //Search the side of the query point first. The other side can only have closer stops
+    //if the splitting line is closer than the worst of the best stops so far.
+    long int diff = by_y ? static_cast<long int>(xy.y) - point.xy.y : static_cast<long int>(xy.x) - point.xy.x;
+    if (diff < 0) {
+        kd_nearest(lo, mid, !by_y, xy, skip, best, k);
+        if (best.size() < k || diff*diff <= std::get<0>(best.back())) {kd_nearest(mid+1, hi, !by_y, xy, skip, best, k);}
+    }
+    else {
+        kd_nearest(mid+1, hi, !by_y, xy, skip, best, k);
+        if (best.size() < k || diff*diff <= std::get<0>(best.back())) {kd_nearest(lo, mid, !by_y, xy, skip, best, k);}
+    }
+}
 
-    //Sort and take only the first 5 (or less) elements.
-    std::sort(temp.begin(), temp.end(), comp); //O(nlog(n))
-    if (temp.size() > 5) {temp.resize(5);}
+void Datastructures::kd_within(std::uint32_t lo, std::uint32_t hi, bool by_y, Coord xy, long int limit, std::vector<NearStop>& found)
+{
+    if (lo >= hi) {return;}
 
-    //Extract the IDs from the storted stops and return them.
-    for (auto it=temp.begin(); it!=temp.end(); it++) { //O(n)
-        s.push_back(it->id);
+    std::uint32_t mid = lo + (hi-lo) / 2;
+    KdPoint const& point = kd_points[mid];
+    if (point.stop != NO_INDEX) {
+        NearStop candidate = near_stop(point.stop, xy);
+        if (std::get<0>(candidate) <= limit) {found.push_back(candidate);}
     }
 
-    return s;
+    //A side can only have stops within the radius if the splitting line is.
+    long int diff = by_y ? static_cast<long int>(xy.y) - point.xy.y : static_cast<long int>(xy.x) - point.xy.x;
+    if (diff < 0 || diff*diff <= limit) {kd_within(lo, mid, !by_y, xy, limit, found);}
+    if (diff >= 0 || diff*diff <= limit) {kd_within(mid+1, hi, !by_y, xy, limit, found);}
+}
+
+void Datastructures::kd_offer(NearStop const& candidate, std::vector<NearStop>& best, std::size_t k)
+{
+    if (best.size() == k && !(candidate < best.back())) {return;}
+
+    best.insert(std::upper_bound(best.begin(), best.end(), candidate), candidate); //O(k)
+    if (best.size() > k) {best.pop_back();}
 }
 
 bool Datastructures::remove_stop(StopID id)
 {
     //If no stop with the given ID exists, return false.
-    if (stops.find(id) == stops.end()) {return false;}
-    //Otherwise, erase it from its region's children vector.
-    Stop s = stops[id];
-    std::vector<StopID> ch = regions[s.parent].region_stops;
+    StopIdx idx = find_stop(id);
+    if (idx == NO_INDEX) {return false;}
+    //Otherwise, erase it from its region's stop vector by moving the last stop of the region
+    //into its place.
+    if (stop_parents[idx] != NO_INDEX) {
+        region_drop_point(stop_parents[idx], stop_coords[idx]); //O(k)
+        std::vector<StopID>& ch = regions[stop_parents[idx]].region_stops;
+        std::uint32_t pos = stop_region_pos[idx];
+        ch[pos] = ch.back();
+        stop_region_pos[find_stop(ch[pos])] = pos;
+        ch.pop_back(); //O(1)
+    }
 
-    for (auto it=ch.begin(); it!=ch.end(); it++) { //O(m)
-        if (*it == id) {ch.erase(it); break;}
+    //Take the stop out of the routes passing it. The routes are handled from the highest index
+    //down, so that removing a route only moves routes that have been handled already.
+    std::vector<RouteIdx> passing(stop_route_lists[idx].begin(), stop_route_lists[idx].end());
+    std::sort(passing.begin(), passing.end(), std::greater<RouteIdx>());
+    for (RouteIdx r : passing) { //O(k*t) for each route, k is the length of the route and t the number of trips
+        unlink_route(r);
+        std::vector<StopID>& stops = route_stop_lists[r];
+        Timetable& timetable = route_times[r];
+        bool first = stops.front() == id;
+        std::uint32_t kept = 0;
+        bool gap = false;
+        for (std::uint32_t i=0; i<stops.size(); i++) {
+            if (stops[i] == id) {gap = true; continue;}
+            //The neighbours of the removed stop become adjacent. If they are the same stop,
+            //the route stays there, so the repeat is dropped with its times. Repeats the route
+            //had already are kept.
+            if (gap && kept > 0 && stops[kept-1] == stops[i]) {gap = false; continue;}
+            gap = false;
+            stops[kept] = stops[i];
+            timetable[kept].swap(timetable[i]);
+            kept++;
+        }
+        stops.resize(kept);
+        timetable.resize(kept);
+        //A route needs at least two stops, so a shorter one is removed with its trips.
+        if (kept < 2) {remove_route(r); continue;}
+        //The trips are kept in the order of departure from the first stop.
+        if (first) {sort_trips(r);}
+        link_route(r);
     }
-    regions[s.parent].region_stops = ch; //O(n)
 
-    //Then erase it from the sorted and unsorted vectors O(n).
-    for (auto it=sorted_alph.begin(); it!=sorted_alph.end(); it++) {
-        if (*it == id) {sorted_alph.erase(it); break;}
+    //The last stop is moved into the freed index to keep the vectors compact.
+    StopIdx last = stop_ids.size()-1;
+
+    //Then erase it from the orders.
+    NameIdx name = stop_names[idx];
+    alph_order.erase({name, id}); //O(log(n))
+    alph_stale = true;
+    if (name_grams_built) {drop_name_grams(stop_name(idx));}
+    coord_order.erase(coord_key(idx)); //O(log(n))
+    coord_stale = true;
+
+    //Drop the stop from the k-d tree and point the entry of the moved stop to its new index.
+    if (kd_pos[idx] != NO_INDEX) {
+        kd_points[kd_pos[idx]].stop = NO_INDEX;
+        kd_dead++;
     }
-    for (auto it=sorted_coord.begin(); it!=sorted_coord.end(); it++) {
-        if (*it == id) {sorted_coord.erase(it); break;}
+    else {
+        std::uint32_t pos = kd_extra_pos[idx];
+        kd_extra[pos] = kd_extra.back();
+        kd_extra_pos[kd_extra[pos]] = pos;
+        kd_extra.pop_back(); //O(1)
     }
-    for (auto it=unsorted_alph.begin(); it!=unsorted_alph.end(); it++) {
-        if (*it == id) {unsorted_alph.erase(it); break;}
+    if (idx != last) {
+        if (kd_pos[last] != NO_INDEX) {kd_points[kd_pos[last]].stop = idx;}
+        else {kd_extra[kd_extra_pos[last]] = idx;}
+        kd_pos[idx] = kd_pos[last];
+        kd_extra_pos[idx] = kd_extra_pos[last];
     }
-    for (auto it=unsorted_coord.begin(); it!=unsorted_coord.end(); it++) {
-        if (*it == id) {unsorted_coord.erase(it); break;}
+    kd_pos.pop_back();
+    kd_extra_pos.pop_back();
+
+    if (idx != last) {
+        stop_ids[idx] = stop_ids[last];
+        stop_names[idx] = stop_names[last];
+        stop_coords[idx] = stop_coords[last];
+        stop_parents[idx] = stop_parents[last];
+        stop_region_pos[idx] = stop_region_pos[last];
+        stop_routes_out[idx] = std::move(stop_routes_out[last]);
+        stop_routes_in[idx] = std::move(stop_routes_in[last]);
+        stop_route_lists[idx] = std::move(stop_route_lists[last]);
+        stop_index[stop_ids[idx]] = idx;
+
+        //Point the neighbours of the moved stop to its new index. The edges out go first, as
+        //the edges in of their neighbours are found by the old index.
+        for (auto &pair : stop_routes_out[idx]) {
+            if (pair.second.stop == last) {pair.second.stop = idx;}
+            find_edge(stop_routes_in[pair.second.stop], pair.first, last)->stop = idx;
+        }
+        for (auto &pair : stop_routes_in[idx]) {
+            if (pair.second.stop == last) {pair.second.stop = idx;}
+            find_edge(stop_routes_out[pair.second.stop], pair.first)->stop = idx;
+        }
     }
 
-    //Finally, erase the stop from the stops map.
-    stops.erase(id); //O(n)
-
+    //Finally, erase the stop from the stop vectors.
+    stop_ids.pop_back();
+    stop_names.pop_back();
+    stop_coords.pop_back();
+    stop_parents.pop_back();
+    stop_region_pos.pop_back();
+    stop_routes_out.pop_back();
+    stop_routes_in.pop_back();
+    stop_route_lists.pop_back();
+    stop_index.erase(id); //O(1) average
+    drop_name(name);
+
+    csr_stale = true;
+    walks_stale = true;
+    timetable_stale = true;
     return true;
 }
 
-void Datastructures::get_region_superregions(RegionID id, std::vector<RegionID>& v) { //O(k)
-    //Get all the direct and indirect parents of a given region.
-    RegionID parent = regions[id].parent;
-    if (parent != NO_REGION) {
-        v.push_back(parent);
-        get_region_superregions(parent, v);
+void Datastructures::build_region_lca()
+{
+    region_up.assign(1, std::vector<RegionIdx>(regions.size()));
+    std::uint32_t max_depth = 0;
+    for (RegionIdx r=0; r<regions.size(); r++) { //O(k)
+        region_up[0][r] = region_parents[r] == NO_INDEX ? r : region_parents[r];
+        max_depth = std::max(max_depth, region_depth[r]);
+    }
+
+    //Enough levels that the highest one reaches the root from every region.
+    while ((std::uint64_t(1) << (region_up.size()-1)) < max_depth) { //O(k*log(k))
+        std::vector<RegionIdx> const& below = region_up.back();
+        std::vector<RegionIdx> level(regions.size());
+        for (RegionIdx r=0; r<regions.size(); r++) {level[r] = below[below[r]];}
+        region_up.push_back(std::move(level));
     }
+    region_lca_built = true;
+}
+
+void Datastructures::update_region_depths(RegionIdx region)
+{
+    //Only the regions of the subtree get new depths and ancestors, parents before children.
+    std::vector<RegionIdx> order = {region};
+    bool rebuild = false;
+    for (std::size_t i=0; i<order.size(); i++) {
+        RegionIdx r = order[i];
+        region_depth[r] = region_depth[region_parents[r]]+1;
+        //If the tables are too short for the new depth, they are built again.
+        if (region_lca_built && (std::uint64_t(1) << (region_up.size()-1)) < region_depth[r]) {rebuild = true;}
+        order.insert(order.end(), regions[r].children.begin(), regions[r].children.end());
+    }
+    if (!region_lca_built) {return;}
+    if (rebuild) {build_region_lca(); return;}
+    for (RegionIdx r : order) { //O(s*log(k))
+        region_up[0][r] = region_parents[r];
+        for (std::size_t j=1; j<region_up.size(); j++) {region_up[j][r] = region_up[j-1][region_up[j-1][r]];}
+    }
+}
+
+RegionIdx Datastructures::common_region(RegionIdx a, RegionIdx b)
+{
+    if (region_depth[a] < region_depth[b]) {std::swap(a, b);}
+    //Lift the deeper region to the same depth.
+    std::uint32_t diff = region_depth[a] - region_depth[b];
+    for (std::size_t j=0; diff!=0; j++, diff>>=1) { //O(log(k))
+        if (diff & 1) {a = region_up[j][a];}
+    }
+    if (a == b) {return a;}
+    //Then lift both as long as they stay apart. They end up just below the common ancestor,
+    //or at the roots of their trees if there is none.
+    for (std::size_t j=region_up.size(); j-->0;) { //O(log(k))
+        if (region_up[j][a] != region_up[j][b]) {a = region_up[j][a]; b = region_up[j][b];}
+    }
+    if (region_up[0][a] != region_up[0][b]) {return NO_INDEX;}
+    return region_up[0][a];
 }
 
 RegionID Datastructures::stops_common_region(StopID id1, StopID id2)
 {
-    if (stops.find(id1) == stops.end()) {return NO_REGION;}
-    if (stops.find(id2) == stops.end()) {return NO_REGION;}
+    StopIdx idx1 = find_stop(id1);
+    StopIdx idx2 = find_stop(id2);
+    if (idx1 == NO_INDEX || idx2 == NO_INDEX) {return NO_REGION;}
+    if (stop_parents[idx1] == NO_INDEX || stop_parents[idx2] == NO_INDEX) {return NO_REGION;}
+
+    if (!region_lca_built) {build_region_lca();}
+    RegionIdx common = common_region(stop_parents[idx1], stop_parents[idx2]); //O(log(k))
+    if (common == NO_INDEX) {return NO_REGION;}
+    return regions[common].id;
+}
 
-    //Climb up the hierarchy to find all regions to which each stop belongs.
-    std::vector<RegionID> r1 = {stops[id1].parent};
-    std::vector<RegionID> r2 = {stops[id2].parent};
+//PHASE (2) IMPLEMENTATION
 
-    get_region_superregions(r1.front(), r1); //O(k)
-    get_region_superregions(r2.front(), r2); //O(k)
+void Datastructures::clear_all()
+{
+    //The containers are swapped with empty ones, so that they give back their memory too,
+    //which clear would keep.
+    decltype(stop_index)(&stop_memory).swap(stop_index);
+    release(stop_ids);
+    release(stop_names);
+    release(name_chars);
+    release(name_offsets);
+    name_offsets.push_back(0);
+    release(name_table);
+    release(name_uses);
+    names_unused = 0;
+    release(stop_coords);
+    release(stop_parents);
+    release(stop_region_pos);
+    release(stop_routes_out);
+    release(stop_routes_in);
+    release(stop_route_lists);
+    decltype(region_index)(&region_memory).swap(region_index);
+    release(regions);
+    release(region_parents);
+    release(region_depth);
+    release(region_up);
+    region_lca_built = false;
+    alph_order.clear();
+    release(alph_ids);
+    alph_stale = false;
+    coord_order.clear();
+    release(coord_ids);
+    coord_stale = false;
+    decltype(name_grams)(&name_memory).swap(name_grams);
+    name_grams_total = 0;
+    name_grams_stale = 0;
+    name_grams_built = false;
+    release(kd_points);
+    release(kd_extra);
+    release(kd_pos);
+    release(kd_extra_pos);
+    kd_dead = 0;
+
+    decltype(route_index)(&route_memory).swap(route_index);
+    release(route_ids);
+    release(route_stop_lists);
+    release(route_times);
+
+    //The structures built for the searches go with the data.
+    release(csr_offsets);
+    release(csr_next);
+    release(csr_route);
+    release(csr_length);
+    release(csr_in_offsets);
+    release(csr_prev);
+    release(csr_in_route);
+    release(csr_in_length);
+    release(walk_offsets);
+    release(walk_next);
+    release(walk_length);
+    release(walk_time);
+    release(pattern_route);
+    release(pattern_stop_offsets);
+    release(pattern_stops);
+    release(pattern_time_offsets);
+    release(pattern_times);
+    release(pattern_trip_offsets);
+    release(stop_pattern_offsets);
+    release(stop_patterns);
+    release(connections);
+    release(trip_stamp);
+    release(trip_board);
+    release(trip_board_pos);
+    release(ride_stamp);
+    release(ride_label);
+    release(search_records);
+    release(label_stamp);
+    release(label_dist);
+    release(arrival_records);
+    csr_stale = true;
+    timetable_stale = true;
+    walking = false;
+    walks_stale = true;
+
+    //Nothing refers to the arena any more.
+    arena.release();
+}
 
-    //Sort the regions of the second stop.
-    std::sort(r2.begin(), r2.end()); //O(klog(k))
+void Datastructures::set_arena(bool on)
+{
+    clear_all();
+    std::pmr::memory_resource* upstream = std::pmr::new_delete_resource();
+    if (on) {upstream = &arena;}
+    for (Memory* memory : {&stop_memory, &name_memory, &region_memory, &route_memory, &trip_memory, &order_memory}) {
+        memory->upstream = upstream;
+    }
+}
 
-    //For each element in r1 (in order, from lowest to highest in heirarchy), do a binary search to see if a match exists in r2.
-    for (auto it=r1.begin();it!=r1.end();it++) { //O(klog(k))
-        if (std::binary_search(r2.begin(), r2.end(), *it)) {
-            return *it;
-            break;
-        }
+std::vector<std::pair<std::string, std::size_t>> Datastructures::memory_usage()
+{
+    //The pmr containers are counted by their resources, the rest by their capacities. The
+    //trigram lists, the region data and the IDs are counted element by element, so this
+    //is O(n) rather than O(1).
+    std::size_t stops = stop_memory.live + vector_bytes(stop_ids) + vector_bytes(stop_names) + vector_bytes(stop_coords)
+            + vector_bytes(stop_parents) + vector_bytes(stop_region_pos);
+
+    std::size_t names = name_memory.live + string_bytes(name_chars) + vector_bytes(name_offsets) + vector_bytes(name_table) + vector_bytes(name_uses);
+    for (auto const& [key, ids] : name_grams) {names += vector_bytes(ids);}
+
+    std::size_t region_bytes = region_memory.live + vector_bytes(regions) + vector_bytes(region_parents)
+            + vector_bytes(region_depth) + vector_bytes(region_up);
+    for (Region const& region : regions) {
+        //The ID is stored in region_index too.
+        region_bytes += 2*string_bytes(region.id) + string_bytes(region.name) + vector_bytes(region.children)
+                + vector_bytes(region.region_stops);
+    }
+    for (auto const& up : region_up) {region_bytes += vector_bytes(up);}
+
+    std::size_t routes = route_memory.live + vector_bytes(stop_routes_out) + vector_bytes(stop_routes_in) + vector_bytes(stop_route_lists)
+            + vector_bytes(route_ids) + vector_bytes(route_stop_lists)
+            + vector_bytes(csr_offsets) + vector_bytes(csr_next) + vector_bytes(csr_route) + vector_bytes(csr_length)
+            + vector_bytes(csr_in_offsets) + vector_bytes(csr_prev) + vector_bytes(csr_in_route) + vector_bytes(csr_in_length)
+            + vector_bytes(walk_offsets) + vector_bytes(walk_next) + vector_bytes(walk_length) + vector_bytes(walk_time);
+    for (RouteIdx i=0; i<route_ids.size(); i++) {
+        //The ID is stored in route_index too.
+        routes += 2*string_bytes(route_ids[i]) + vector_bytes(route_stop_lists[i]);
     }
 
-    //If all else failed, there is no common region.
-    return NO_REGION;
-}
+    std::size_t trips = trip_memory.live + vector_bytes(route_times) + vector_bytes(pattern_route)
+            + vector_bytes(pattern_stop_offsets) + vector_bytes(pattern_stops) + vector_bytes(pattern_time_offsets)
+            + vector_bytes(pattern_times) + vector_bytes(pattern_trip_offsets) + vector_bytes(stop_pattern_offsets)
+            + vector_bytes(stop_patterns) + vector_bytes(connections);
 
-//PHASE (2) IMPLEMENTATION
+    std::size_t orders = order_memory.live + vector_bytes(alph_ids) + vector_bytes(coord_ids) + vector_bytes(kd_points)
+            + vector_bytes(kd_extra) + vector_bytes(kd_pos) + vector_bytes(kd_extra_pos);
 
-void Datastructures::clear_all()
+    std::size_t searches = vector_bytes(search_records) + vector_bytes(label_stamp) + vector_bytes(label_dist)
+            + vector_bytes(arrival_records) + vector_bytes(trip_stamp) + vector_bytes(trip_board)
+            + vector_bytes(trip_board_pos) + vector_bytes(ride_stamp) + vector_bytes(ride_label);
+
+    return {{"stops", stops}, {"names", names}, {"regions", region_bytes}, {"routes", routes},
+            {"trips", trips}, {"sort caches", orders}, {"searches", searches}};
+}
+
+bool Datastructures::save_snapshot(std::string const& filename)
 {
-    stops.clear();
-    regions.clear();
-    sorted_alph.clear();
-    unsorted_alph.clear();
-    sorted_coord.clear();
-    unsorted_coord.clear();
-    flag_alph = false;
-    flag_coord = false;
+    SnapshotWriter out;
+
+    out.put_vector(stop_ids);
+    out.put_vector(stop_names);
+    out.put_vector(stop_coords);
+    out.put_vector(stop_parents);
+    out.put_vector(stop_region_pos);
+    out.put_string(name_chars);
+    out.put_vector(name_offsets);
+    out.put_vector(name_table);
+    for (auto const* edges : {&stop_routes_out, &stop_routes_in}) {
+        for (RouteEdges const& stop_edges : *edges) {
+            out.put<std::uint64_t>(stop_edges.size());
+            for (auto const& [route, edge] : stop_edges) {
+                out.put(route);
+                out.put(edge);
+            }
+        }
+    }
+    for (auto const& routes : stop_route_lists) {out.put_vector(routes);}
+
+    out.put<std::uint64_t>(regions.size());
+    for (Region const& region : regions) {
+        out.put_string(region.id);
+        out.put_string(region.name);
+        out.put_vector(region.children);
+        out.put_vector(region.region_stops);
+        out.put(region.box_min);
+        out.put(region.box_max);
+        out.put(region.stop_count);
+        out.put(region.box_stale);
+    }
+    out.put_vector(region_parents);
+    out.put_vector(region_depth);
+    out.put(region_lca_built);
+    if (region_lca_built) {
+        out.put<std::uint64_t>(region_up.size());
+        for (auto const& up : region_up) {out.put_vector(up);}
+    }
 
-    routes.clear();
-    trips.clear();
+    out.put<std::uint64_t>(route_ids.size());
+    for (RouteIdx i=0; i<route_ids.size(); i++) {
+        out.put_string(route_ids[i]);
+        out.put_vector(route_stop_lists[i]);
+        out.put<std::uint64_t>(route_times[i].size());
+        for (auto const& column : route_times[i]) {out.put_vector(column);}
+    }
+    out.put(walking);
+    out.put(walking_radius);
+
+    //The orders as stop indexes, so that loading them takes no comparisons.
+    std::vector<StopIdx> order;
+    order.reserve(stop_ids.size());
+    for (NameKey const& key : alph_order) {order.push_back(find_stop(key.second));}
+    out.put_vector(order);
+    order.clear();
+    for (CoordKey const& key : coord_order) {order.push_back(find_stop(std::get<2>(key)));}
+    out.put_vector(order);
+    out.put_vector(kd_points);
+    out.put_vector(kd_extra);
+    out.put_vector(kd_pos);
+    out.put_vector(kd_extra_pos);
+    out.put(kd_dead);
+
+    std::ofstream file(filename, std::ios::binary);
+    std::uint64_t size = out.bytes.size();
+    std::uint64_t hash = snapshot_hash(out.bytes);
+    file.write(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    file.write(reinterpret_cast<char const*>(&SNAPSHOT_VERSION), sizeof(SNAPSHOT_VERSION));
+    file.write(reinterpret_cast<char const*>(&size), sizeof(size));
+    file.write(reinterpret_cast<char const*>(&hash), sizeof(hash));
+    file.write(out.bytes.data(), out.bytes.size());
+    return static_cast<bool>(file.flush());
 }
 
-std::vector<RouteID> Datastructures::all_routes()
+bool Datastructures::load_snapshot(std::string const& filename)
 {
-    std::vector<RouteID> r;
+    clear_all();
+
+    std::ifstream file(filename, std::ios::binary);
+    std::string bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    std::size_t header = sizeof(SNAPSHOT_MAGIC) + sizeof(SNAPSHOT_VERSION) + 2*sizeof(std::uint64_t);
+    if (!file || bytes.size() < header) {return false;}
+
+    SnapshotReader in{bytes.data()};
+    if (std::memcmp(in.pos, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {return false;}
+    in.pos += sizeof(SNAPSHOT_MAGIC);
+    if (in.get<std::uint32_t>() != SNAPSHOT_VERSION) {return false;}
+    auto size = in.get<std::uint64_t>();
+    auto hash = in.get<std::uint64_t>();
+    if (size != bytes.size()-header || hash != snapshot_hash(std::string_view(bytes).substr(header))) {return false;}
+
+    in.get_vector(stop_ids);
+    in.get_vector(stop_names);
+    in.get_vector(stop_coords);
+    in.get_vector(stop_parents);
+    in.get_vector(stop_region_pos);
+    name_chars = in.get_string();
+    in.get_vector(name_offsets);
+    in.get_vector(name_table);
+    name_uses.assign(name_offsets.size()-1, 0);
+    for (NameIdx handle : stop_names) {name_uses[handle]++;}
+    names_unused = std::count(name_uses.begin(), name_uses.end(), 0);
+    for (auto* edges : {&stop_routes_out, &stop_routes_in}) {
+        edges->reserve(stop_ids.size());
+        for (StopIdx i=0; i<stop_ids.size(); i++) {
+            RouteEdges& stop_edges = edges->emplace_back(&route_memory);
+            stop_edges.resize(in.get<std::uint64_t>());
+            for (auto& [route, edge] : stop_edges) {
+                route = in.get<RouteIdx>();
+                edge = in.get<RouteEdge>();
+            }
+        }
+    }
+    stop_route_lists.reserve(stop_ids.size());
+    for (StopIdx i=0; i<stop_ids.size(); i++) {in.get_vector(stop_route_lists.emplace_back(&route_memory));}
+    stop_index.reserve(stop_ids.size());
+    for (StopIdx i=0; i<stop_ids.size(); i++) {stop_index.emplace(stop_ids[i], i);}
+
+    regions.resize(in.get<std::uint64_t>());
+    region_index.reserve(regions.size());
+    for (RegionIdx r=0; r<regions.size(); r++) {
+        Region& region = regions[r];
+        region.id = in.get_string();
+        region.name = in.get_string();
+        in.get_vector(region.children);
+        in.get_vector(region.region_stops);
+        region.box_min = in.get<Coord>();
+        region.box_max = in.get<Coord>();
+        region.stop_count = in.get<std::uint32_t>();
+        region.box_stale = in.get<bool>();
+        region_index.emplace(region.id, r);
+    }
+    in.get_vector(region_parents);
+    in.get_vector(region_depth);
+    region_lca_built = in.get<bool>();
+    if (region_lca_built) {
+        region_up.resize(in.get<std::uint64_t>());
+        for (auto& up : region_up) {in.get_vector(up);}
+    }
 
-    for (auto it=routes.begin(); it!=routes.end(); it++) {
-        r.push_back(it->first);
+    auto route_count = in.get<std::uint64_t>();
+    route_ids.reserve(route_count);
+    route_stop_lists.resize(route_count);
+    route_times.reserve(route_count);
+    route_index.reserve(route_count);
+    for (RouteIdx i=0; i<route_count; i++) {
+        route_ids.push_back(in.get_string());
+        route_index.emplace(route_ids[i], i);
+        in.get_vector(route_stop_lists[i]);
+        Timetable& times = route_times.emplace_back(in.get<std::uint64_t>(), &trip_memory);
+        for (auto& column : times) {in.get_vector(column);}
     }
+    walking = in.get<bool>();
+    walking_radius = in.get<Distance>();
+
+    //In order, so every insertion goes right after the previous one in O(1).
+    std::vector<StopIdx> order;
+    in.get_vector(order);
+    for (StopIdx i : order) {alph_order.emplace_hint(alph_order.end(), stop_names[i], stop_ids[i]);}
+    alph_stale = true;
+    in.get_vector(order);
+    for (StopIdx i : order) {coord_order.emplace_hint(coord_order.end(), coord_key(i));}
+    coord_stale = true;
+    in.get_vector(kd_points);
+    in.get_vector(kd_extra);
+    in.get_vector(kd_pos);
+    in.get_vector(kd_extra_pos);
+    kd_dead = in.get<std::uint32_t>();
 
-    return r;
+    return true;
+}
+
+RouteIdx Datastructures::find_route(RouteID id)
+{
+    auto it = route_index.find(id);
+    if (it == route_index.end()) {return NO_INDEX;}
+    return it->second;
+}
+
+std::vector<RouteID> Datastructures::all_routes()
+{
+    return route_ids;
 }
 
 bool Datastructures::add_route(RouteID id, std::vector<StopID> route_stops)
 {
     //If there already exists a route with the same ID.
-    if (routes.find(id) != routes.end()) {return false;}
+    if (find_route(id) != NO_INDEX) {return false;}
 
     //Or if some stop's ID is not found (a stop in the route doesn't exist).
+    std::vector<StopIdx> idxs;
     for (auto it=route_stops.begin(); it!=route_stops.end(); it++) {
-        if (stops.find(*it) == stops.end()) {return false; break;}
+        idxs.push_back(find_stop(*it));
+        if (idxs.back() == NO_INDEX) {return false;}
     }
 
     //Or if there is given only one stop.
     if (route_stops.size() <= 1) {return false;}
 
     //Otherwise, add the new route.
-    routes.insert(std::pair<RouteID, std::vector<StopID>>(id, route_stops));
-
-    for (auto it=route_stops.begin(); it!=std::prev(route_stops.end()); it++) {
-        stops[*it].routes_out.insert(std::pair<RouteID, StopID>(id, *std::next(it)));
+    route_index.insert(std::pair<RouteID, RouteIdx>(id, route_ids.size()));
+    route_ids.push_back(id);
+    route_stop_lists.push_back(route_stops);
+    route_times.push_back(Timetable(route_stops.size(), &trip_memory));
+    RouteIdx route = route_ids.size()-1;
+    for (StopIdx stop : idxs) {
+        auto& routes = stop_route_lists[stop];
+        if (std::find(routes.begin(), routes.end(), route) == routes.end()) {routes.push_back(route);} //O(d)
     }
+    link_route(route);
 
+    csr_stale = true;
+    timetable_stale = true;
     return true;
 }
 
+void Datastructures::link_route(RouteIdx route)
+{
+    std::vector<StopID> const& stops = route_stop_lists[route];
+    for (std::uint32_t i=0; i+1<stops.size(); i++) { //O(k), k is the number of stops on the route
+        //A stop keeps at most one edge out per route. If the route leaves the same stop
+        //again, only the first edge out is kept.
+        StopIdx a = find_stop(stops[i]); StopIdx b = find_stop(stops[i+1]);
+        if (a == NO_INDEX || b == NO_INDEX) {continue;}
+        if (find_edge(stop_routes_out[a], route) != nullptr) {continue;}
+        //The edge length is computed once here and kept up to date by change_stop_coord.
+        Distance length = calc_dist(a, b);
+        stop_routes_out[a].push_back(std::pair<RouteIdx, RouteEdge>(route, {b, length}));
+        stop_routes_in[b].push_back(std::pair<RouteIdx, RouteEdge>(route, {a, length}));
+    }
+}
+
+Datastructures::RouteEdge* Datastructures::find_edge(RouteEdges& edges, RouteIdx route)
+{
+    for (auto &pair : edges) { //O(d), d is the number of routes of the stop
+        if (pair.first == route) {return &pair.second;}
+    }
+    return nullptr;
+}
+
+Datastructures::RouteEdge* Datastructures::find_edge(RouteEdges& edges, RouteIdx route, StopIdx stop)
+{
+    for (auto &pair : edges) { //O(d)
+        if (pair.first == route && pair.second.stop == stop) {return &pair.second;}
+    }
+    return nullptr;
+}
+
+void Datastructures::erase_edge(RouteEdges& edges, RouteIdx route)
+{
+    auto it = std::remove_if(edges.begin(), edges.end(), [route](auto const& pair) {return pair.first == route;});
+    edges.erase(it, edges.end()); //O(d)
+}
+
+void Datastructures::unlink_route(RouteIdx route)
+{
+    for (StopID stop : route_stop_lists[route]) { //O(k)
+        StopIdx idx = find_stop(stop);
+        if (idx == NO_INDEX) {continue;}
+        erase_edge(stop_routes_out[idx], route);
+        erase_edge(stop_routes_in[idx], route);
+    }
+}
+
+void Datastructures::remove_route(RouteIdx route)
+{
+    RouteIdx last = route_ids.size()-1;
+    route_index.erase(route_ids[route]);
+    for (StopID stop : route_stop_lists[route]) { //O(k*d)
+        StopIdx idx = find_stop(stop);
+        auto& routes = stop_route_lists[idx];
+        auto it = std::find(routes.begin(), routes.end(), route);
+        if (it != routes.end()) {routes.erase(it);}
+    }
+    if (route != last) {
+        for (StopID stop : route_stop_lists[last]) {
+            StopIdx idx = find_stop(stop);
+            std::replace(stop_route_lists[idx].begin(), stop_route_lists[idx].end(), last, route);
+        }
+        //The edges of the moved route are keyed by its index, so they move with it.
+        unlink_route(last);
+        route_ids[route] = std::move(route_ids[last]);
+        route_stop_lists[route] = std::move(route_stop_lists[last]);
+        route_times[route] = std::move(route_times[last]);
+        route_index[route_ids[route]] = route;
+        link_route(route);
+    }
+    route_ids.pop_back();
+    route_stop_lists.pop_back();
+    route_times.pop_back();
+}
+
+void Datastructures::sort_trips(RouteIdx route)
+{
+    Timetable& timetable = route_times[route];
+    std::vector<std::uint32_t> order(timetable.front().size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&timetable](std::uint32_t a, std::uint32_t b) {
+        return timetable.front()[a] < timetable.front()[b];
+    }); //O(tlog(t)), t is the number of trips
+    for (auto& column : timetable) { //O(t*k)
+        std::pmr::vector<Time> sorted(column.size(), &trip_memory);
+        for (std::uint32_t t=0; t<order.size(); t++) {sorted[t] = column[order[t]];}
+        column.swap(sorted);
+    }
+}
+
 std::vector<std::pair<RouteID, StopID>> Datastructures::routes_from(StopID stopid)
 {
-    if (stops.find(stopid) == stops.end()) {return {{NO_ROUTE, NO_STOP}};}
+    StopIdx idx = find_stop(stopid);
+    if (idx == NO_INDEX) {return {{NO_ROUTE, NO_STOP}};}
 
     std::vector<std::pair<RouteID, StopID>> required_routes;
 
-    for (auto &pair : stops[stopid].routes_out) {
-        required_routes.push_back(pair);
+    for (auto &pair : stop_routes_out[idx]) {
+        required_routes.push_back(std::pair<RouteID, StopID>(route_ids[pair.first], stop_ids[pair.second.stop]));
     }
 
     return required_routes;
@@ -528,139 +1469,298 @@ std::vector<std::pair<RouteID, StopID>> Datastructures::routes_from(StopID stopi
 
 std::vector<StopID> Datastructures::route_stops(RouteID id)
 {
-    if (routes.find(id) == routes.end()) {return {NO_STOP};}
+    RouteIdx route = find_route(id);
+    if (route == NO_INDEX) {return {NO_STOP};}
 
-    return routes[id];
+    return route_stop_lists[route];
 }
 
 void Datastructures::clear_routes()
 {
-    for (auto it=stops.begin(); it!=stops.end(); it++) {
-        it->second.routes_out.clear();
+    for (StopIdx i=0; i<stop_ids.size(); i++) {
+        stop_routes_out[i].clear();
+        stop_routes_in[i].clear();
+        stop_route_lists[i].clear();
     }
 
-    routes.clear();
+    route_index.clear();
+    route_ids.clear();
+    route_stop_lists.clear();
+    route_times.clear();
+    csr_stale = true;
+    timetable_stale = true;
 }
 
-Distance Datastructures::calc_dist(StopID a, StopID b) {
-    return sqrt(pow(stops[a].location.x-stops[b].location.x, 2) + pow(stops[a].location.y-stops[b].location.y, 2));
+void Datastructures::build_csr()
+{
+    StopIdx n = stop_ids.size();
+    csr_offsets.assign(n+1, 0);
+    csr_next.clear();
+    csr_route.clear();
+    csr_length.clear();
+
+    //The edges of each stop are laid out in the order of its routes_out edges.
+    for (StopIdx i=0; i<n; i++) { //O(n+e)
+        csr_offsets[i] = csr_next.size();
+        for (auto &pair : stop_routes_out[i]) {
+            csr_next.push_back(pair.second.stop);
+            csr_route.push_back(pair.first);
+            csr_length.push_back(pair.second.length);
+        }
+    }
+    csr_offsets[n] = csr_next.size();
+
+    //The same for the edges coming in to each stop, in the order of routes_in.
+    csr_in_offsets.assign(n+1, 0);
+    csr_prev.clear();
+    csr_in_route.clear();
+    csr_in_length.clear();
+    for (StopIdx i=0; i<n; i++) { //O(n+e)
+        csr_in_offsets[i] = csr_prev.size();
+        for (auto &pair : stop_routes_in[i]) {
+            csr_prev.push_back(pair.second.stop);
+            csr_in_route.push_back(pair.first);
+            csr_in_length.push_back(pair.second.length);
+        }
+    }
+    csr_in_offsets[n] = csr_prev.size();
+
+    heuristic_scale = 1.0;
+    for (StopIdx i=0; i<n; i++) { //O(e)
+        for (std::uint32_t e=csr_offsets[i]; e<csr_offsets[i+1]; e++) {
+            lower_heuristic_scale(i, csr_next[e], csr_length[e]);
+        }
+    }
+    for (StopIdx i=0; i<n && !walks_stale; i++) { //O(w), w is the number of walks
+        for (std::uint32_t e=walk_offsets[i]; e<walk_offsets[i+1]; e++) {
+            lower_heuristic_scale(i, walk_next[e], walk_length[e]);
+        }
+    }
+
+    csr_stale = false;
 }
 
-std::vector<std::tuple<StopID, RouteID, Distance>> Datastructures::journey_any(StopID fromstop, StopID tostop)
+void Datastructures::set_csr_length(StopIdx from, RouteIdx r, Distance length)
 {
-    //If either of the stops isn't found.
-    if (stops.find(fromstop) == stops.end() || stops.find(tostop) == stops.end()) {return {{NO_STOP, NO_ROUTE, NO_DISTANCE}};}
-    //If the starting stop is the same as the destination stop.
-    if (fromstop == tostop) {return {};}
+    if (csr_stale) {return;}
 
+    for (std::uint32_t e=csr_offsets[from]; e<csr_offsets[from+1]; e++) { //O(d), d is the number of routes from the stop
+        if (csr_route[e] != r) {continue;}
 
-    //The stack which will hold the fringe stops and the paths leading to them.
-    std::stack<std::pair<StopID, std::vector<std::tuple<StopID, RouteID, Distance>>>> thestack;
-    //A boolean map that holds the visited stops.
-    std::unordered_map<StopID, bool> visited;
-    //Initialize the stack with the starting stop.
-    thestack.push(std::pair<StopID, std::vector<std::tuple<StopID, RouteID, Distance>>>(fromstop, {}));
+        csr_length[e] = length;
+        lower_heuristic_scale(from, csr_next[e], length);
 
-    while (thestack.size() != 0) {
-
-        auto popped = thestack.top();
-        thestack.pop();
+        //The same edge in the reverse direction.
+        StopIdx to = csr_next[e];
+        for (std::uint32_t f=csr_in_offsets[to]; f<csr_in_offsets[to+1]; f++) {
+            if (csr_in_route[f] == r && csr_prev[f] == from) {csr_in_length[f] = length; return;}
+        }
+        return;
+    }
+}
 
-        StopID crntstop = popped.first;
-        auto crntpath = popped.second;
+void Datastructures::lower_heuristic_scale(StopIdx a, StopIdx b, Distance length)
+{
+    double straight = std::hypot(stop_coords[a].x-stop_coords[b].x, stop_coords[a].y-stop_coords[b].y);
+    //The margin keeps rounding errors from making the heuristic overestimate.
+    if (straight > 0) {heuristic_scale = std::min(heuristic_scale, length/straight*(1-1e-9));}
+}
 
+Distance Datastructures::calc_dist(StopIdx a, StopIdx b) {
+    return sqrt(pow(stop_coords[a].x-stop_coords[b].x, 2) + pow(stop_coords[a].y-stop_coords[b].y, 2));
+}
 
-        if (crntstop == tostop) {
-            StopID prevstop = std::get<0>(crntpath.back());
-            Distance nextdist = calc_dist(prevstop, tostop);
-            Distance prevdist = std::get<2>(crntpath.back());
-            crntpath.push_back(std::tuple<StopID, RouteID, Distance>(crntstop, NO_ROUTE, nextdist+prevdist));
-            return crntpath;
-        }
+void Datastructures::start_labelled_search()
+{
+    if (walks_stale) {build_walks();}
+    if (csr_stale) {build_csr();}
+    search_records.clear();
+    settled_count = 0;
+
+    //Labels are only cleared when the stamps wrap around or the number of stops changes.
+    search_stamp += 2;
+    if (label_stamp.size() != stop_ids.size() || search_stamp < 2) {
+        label_stamp.assign(stop_ids.size(), 0);
+        label_dist.resize(stop_ids.size());
+        search_stamp = 2;
+        //The trip and ride stamps restart with the labels, so the engines refill them.
+        trip_stamp.clear();
+        ride_stamp.clear();
+    }
+}
 
-        visited[crntstop] = true;
+Distance Datastructures::get_label(StopIdx stop)
+{
+    if (label_stamp[stop] < search_stamp) {return std::numeric_limits<Distance>::max();}
+    return label_dist[stop];
+}
 
-        auto successors = routes_from(crntstop);
+void Datastructures::set_label(StopIdx stop, Distance dist)
+{
+    label_stamp[stop] = search_stamp;
+    label_dist[stop] = dist;
+}
 
-        for (auto it=successors.begin(); it!=successors.end(); it++) {
-            if (visited[it->second] == true) {continue;}
+bool Datastructures::is_settled(StopIdx stop)
+{
+    return label_stamp[stop] == search_stamp+1;
+}
 
-            RouteID nextroute = it->first;
-            StopID nextstop = it->second;
-            Distance prevdist, nextdist;
+void Datastructures::settle(StopIdx stop)
+{
+    label_stamp[stop] = search_stamp+1;
+    settled_count++;
+}
 
-            if (crntpath.size()==0) {prevdist=0; nextdist=0;}
-            else {
-                prevdist = std::get<2>(crntpath.back());
-                StopID prevstop = std::get<0>(crntpath.back());
-                nextdist = calc_dist(prevstop, crntstop);
-            }
+int Datastructures::stops_settled()
+{
+    return settled_count;
+}
 
-            auto newpath = crntpath;
+int Datastructures::push_search_record(StopIdx stop, RouteIdx route, int prev, Distance length)
+{
+    //The distance is accumulated edge by edge, so every leg is truncated on its own.
+    Distance dist = 0;
+    if (prev != -1) {dist = search_records[prev].dist + length;}
 
-            newpath.push_back(std::tuple<StopID, RouteID, Distance>(crntstop, nextroute, prevdist+nextdist));
-            thestack.push(std::pair<StopID, std::vector<std::tuple<StopID, RouteID, Distance>>>(nextstop, newpath));
-        }
+    search_records.push_back({stop, route, prev, dist});
+    return search_records.size()-1;
+}
 
+std::vector<std::tuple<StopID, RouteID, Distance>> Datastructures::rebuild_journey(int last)
+{
+    //Walk the predecessor chain back to the starting stop. Each record holds the route used
+    //to arrive at it, which is the route leaving its predecessor.
+    std::vector<std::tuple<StopID, RouteID, Distance>> journey;
+    RouteID route = NO_ROUTE;
+
+    for (int i=last; i!=-1; i=search_records[i].prev) {
+        journey.push_back(std::tuple<StopID, RouteID, Distance>(stop_ids[search_records[i].stop], route, search_records[i].dist));
+        if (search_records[i].route == WALK_INDEX) {route = WALK_ROUTE;}
+        else if (search_records[i].route != NO_INDEX) {route = route_ids[search_records[i].route];}
     }
 
-    return {};
+    std::reverse(journey.begin(), journey.end());
+    return journey;
 }
 
-std::vector<std::tuple<StopID, RouteID, Distance>> Datastructures::journey_least_stops(StopID fromstop, StopID tostop)
+std::vector<std::tuple<StopID, RouteID, Distance>> Datastructures::journey_any(StopID fromstop, StopID tostop)
 {
     //If either of the stops isn't found.
-    if (stops.find(fromstop) == stops.end() || stops.find(tostop) == stops.end()) {return {{NO_STOP, NO_ROUTE, NO_DISTANCE}};}
+    StopIdx from = find_stop(fromstop);
+    StopIdx to = find_stop(tostop);
+    if (from == NO_INDEX || to == NO_INDEX) {return {{NO_STOP, NO_ROUTE, NO_DISTANCE}};}
     //If the starting stop is the same as the destination stop.
-    if (fromstop == tostop) {return {};}
+    if (from == to) {return {};}
 
-    std::queue<std::pair<StopID, std::vector<std::tuple<StopID, RouteID, Distance>>>> thequeue;
+    //The stack holds the indices of the fringe records, the paths live in search_records.
+    std::stack<int> thestack;
+    //A boolean map that holds the visited stops.
+    std::vector<bool> visited(stop_ids.size(), false);
+    //Initialize the stack with the starting stop.
+    if (csr_stale) {build_csr();}
+    search_records.clear();
+    thestack.push(push_search_record(from, NO_INDEX, -1, 0));
 
-    std::unordered_map<StopID, bool> visited;
+    while (thestack.size() != 0) {
 
-    thequeue.push(std::pair<StopID, std::vector<std::tuple<StopID, RouteID, Distance>>>(fromstop, {}));
+        int crnt = thestack.top();
+        thestack.pop();
 
-    while (thequeue.size() != 0) {
+        StopIdx crntstop = search_records[crnt].stop;
 
-        auto popped = thequeue.front();
-        thequeue.pop();
-
-        StopID crntstop = popped.first;
-        auto crntpath = popped.second;
+        if (crntstop == to) {return rebuild_journey(crnt);}
 
+        visited[crntstop] = true;
 
-        if (crntstop == tostop) {
-            StopID prevstop = std::get<0>(crntpath.back());
-            Distance nextdist = calc_dist(prevstop, tostop);
-            Distance prevdist = std::get<2>(crntpath.back());
-            crntpath.push_back(std::tuple<StopID, RouteID, Distance>(crntstop, NO_ROUTE, nextdist+prevdist));
-            return crntpath;
+        for (std::uint32_t e=csr_offsets[crntstop]; e<csr_offsets[crntstop+1]; e++) {
+            if (visited[csr_next[e]] == true) {continue;}
+            thestack.push(push_search_record(csr_next[e], csr_route[e], crnt, csr_length[e]));
         }
 
-        visited[crntstop] = true;
+    }
 
-        auto successors = routes_from(crntstop);
+    return {};
+}
 
-        for (auto it=successors.begin(); it!=successors.end(); it++) {
-            if (visited[it->second] == true) {continue;}
+std::vector<std::tuple<StopID, RouteID, Distance>> Datastructures::journey_least_stops(StopID fromstop, StopID tostop)
+{
+    //If either of the stops isn't found.
+    StopIdx from = find_stop(fromstop);
+    StopIdx to = find_stop(tostop);
+    if (from == NO_INDEX || to == NO_INDEX) {return {{NO_STOP, NO_ROUTE, NO_DISTANCE}};}
+    //If the starting stop is the same as the destination stop.
+    if (from == to) {return {};}
+
+    //Bidirectional breadth-first search. The forward search follows the routes going out
+    //of the stops and the backward search the routes coming in to them. A whole level is
+    //expanded at a time, always on the side with the smaller frontier. When an edge joins
+    //the searches, every stop of the other side next to the current level is on its last
+    //level, so the first joining edge gives a journey with the least stops.
+    //The labels hold record indices: a stop reached forwards has the stamp search_stamp and
+    //its record is in search_records, a stop reached backwards has the stamp search_stamp+1
+    //and its record is in backward.
+    start_labelled_search();
+
+    //Records of the backward search: the stop, the route from the stop towards the
+    //destination, the next record towards the destination and the length of that edge.
+    std::vector<SearchRecord> backward;
+
+    std::vector<int> forward_level;
+    std::vector<int> backward_level;
+    std::vector<int> next_level;
+
+    forward_level.push_back(push_search_record(from, NO_INDEX, -1, 0));
+    set_label(from, forward_level.back());
+    backward.push_back({to, NO_INDEX, -1, 0});
+    backward_level.push_back(0);
+    label_stamp[to] = search_stamp+1;
+    label_dist[to] = 0;
+
+    //Joins forward record f to backward record b with an edge from f's stop to b's stop
+    //and copies the backward part into search_records.
+    auto join = [this, &backward](int f, RouteIdx route, Distance length, int b) {
+        int last = push_search_record(backward[b].stop, route, f, length);
+        for (; backward[b].prev != -1; b = backward[b].prev) { //O(k), k is the number of stops in the journey
+            last = push_search_record(backward[backward[b].prev].stop, backward[b].route, last, backward[b].dist);
+        }
+        return rebuild_journey(last);
+    };
 
-            RouteID nextroute = it->first;
-            StopID nextstop = it->second;
-            Distance prevdist, nextdist;
+    while (forward_level.size() != 0 && backward_level.size() != 0) {
 
-            if (crntpath.size()==0) {prevdist=0; nextdist=0;}
-            else {
-                prevdist = std::get<2>(crntpath.back());
-                StopID prevstop = std::get<0>(crntpath.back());
-                nextdist = calc_dist(prevstop, crntstop);
-            }
+        next_level.clear();
 
-            auto newpath = crntpath;
+        if (forward_level.size() <= backward_level.size()) {
+            for (int crnt : forward_level) {
+                StopIdx crntstop = search_records[crnt].stop;
+                for (std::uint32_t e=csr_offsets[crntstop]; e<csr_offsets[crntstop+1]; e++) {
+                    StopIdx nextstop = csr_next[e];
+                    if (label_stamp[nextstop] == search_stamp+1) {return join(crnt, csr_route[e], csr_length[e], label_dist[nextstop]);}
+                    if (label_stamp[nextstop] == search_stamp) {continue;}
 
-            newpath.push_back(std::tuple<StopID, RouteID, Distance>(crntstop, nextroute, prevdist+nextdist));
-            thequeue.push(std::pair<StopID, std::vector<std::tuple<StopID, RouteID, Distance>>>(nextstop, newpath));
+                    next_level.push_back(push_search_record(nextstop, csr_route[e], crnt, csr_length[e]));
+                    set_label(nextstop, next_level.back());
+                }
+            }
+            forward_level.swap(next_level);
+        }
+        else {
+            for (int crnt : backward_level) {
+                StopIdx crntstop = backward[crnt].stop;
+                for (std::uint32_t e=csr_in_offsets[crntstop]; e<csr_in_offsets[crntstop+1]; e++) {
+                    StopIdx prevstop = csr_prev[e];
+                    if (label_stamp[prevstop] == search_stamp) {return join(label_dist[prevstop], csr_in_route[e], csr_in_length[e], crnt);}
+                    if (label_stamp[prevstop] == search_stamp+1) {continue;}
+
+                    backward.push_back({prevstop, csr_in_route[e], crnt, csr_in_length[e]});
+                    next_level.push_back(backward.size()-1);
+                    label_stamp[prevstop] = search_stamp+1;
+                    label_dist[prevstop] = backward.size()-1;
+                }
+            }
+            backward_level.swap(next_level);
         }
-
     }
 
     return {};
@@ -669,51 +1769,47 @@ std::vector<std::tuple<StopID, RouteID, Distance>> Datastructures::journey_least
 std::vector<std::tuple<StopID, RouteID, Distance>> Datastructures::journey_with_cycle(StopID fromstop)
 {
     //If the stop isn't found.
-    if (stops.find(fromstop) == stops.end()) {return {{NO_STOP, NO_ROUTE, NO_DISTANCE}};}
+    StopIdx from = find_stop(fromstop);
+    if (from == NO_INDEX) {return {{NO_STOP, NO_ROUTE, NO_DISTANCE}};}
 
-    //The stack which will hold the fringe stops and the paths leading to them.
-    std::stack<std::pair<StopID, std::vector<std::tuple<StopID, RouteID, Distance>>>> thestack;
+    //The stack which will hold the fringe records.
+    std::stack<int> thestack;
+    //The records of the path currently being explored, and the stops on it.
+    std::vector<int> path;
+    std::vector<bool> on_path(stop_ids.size(), false);
+    //Stops whose every continuation has been explored without finding a cycle.
+    std::vector<bool> done(stop_ids.size(), false);
 
     //Initialize the stack with the starting stop.
-    thestack.push(std::pair<StopID, std::vector<std::tuple<StopID, RouteID, Distance>>>(fromstop, {}));
+    if (csr_stale) {build_csr();}
+    search_records.clear();
+    thestack.push(push_search_record(from, NO_INDEX, -1, 0));
 
     while (thestack.size() != 0) {
 
-        auto popped = thestack.top();
+        int crnt = thestack.top();
         thestack.pop();
 
-        StopID crntstop = popped.first;
-        auto crntpath = popped.second;
-
-        for (auto &tuple : crntpath) {
-            if (crntstop == std::get<0>(tuple)){
-                StopID prevstop = std::get<0>(crntpath.back());
-                Distance nextdist = calc_dist(prevstop, crntstop);
-                Distance prevdist = std::get<2>(crntpath.back());
-                crntpath.push_back(std::tuple<StopID, RouteID, Distance>(crntstop, NO_ROUTE, nextdist+prevdist));
-                return crntpath;
-            }
+        //Backtrack until the path ends at the record this one was reached from.
+        while (path.size() != 0 && path.back() != search_records[crnt].prev) {
+            StopIdx finished = search_records[path.back()].stop;
+            on_path[finished] = false;
+            done[finished] = true;
+            path.pop_back();
         }
 
-        auto successors = routes_from(crntstop);
-
-        for (auto it=successors.begin(); it!=successors.end(); it++) {
+        StopIdx crntstop = search_records[crnt].stop;
 
-            RouteID nextroute = it->first;
-            StopID nextstop = it->second;
-            Distance prevdist, nextdist;
-
-            if (crntpath.size()==0) {prevdist=0; nextdist=0;}
-            else {
-                prevdist = std::get<2>(crntpath.back());
-                StopID prevstop = std::get<0>(crntpath.back());
-                nextdist = calc_dist(prevstop, crntstop);
-            }
+        //Arriving at a stop which is already on the path closes the cycle.
+        if (on_path[crntstop] == true) {return rebuild_journey(crnt);}
+        if (done[crntstop] == true) {continue;}
 
-            auto newpath = crntpath;
+        path.push_back(crnt);
+        on_path[crntstop] = true;
 
-            newpath.push_back(std::tuple<StopID, RouteID, Distance>(crntstop, nextroute, prevdist+nextdist));
-            thestack.push(std::pair<StopID, std::vector<std::tuple<StopID, RouteID, Distance>>>(nextstop, newpath));
+        for (std::uint32_t e=csr_offsets[crntstop]; e<csr_offsets[crntstop+1]; e++) {
+            if (done[csr_next[e]] == true) {continue;}
+            thestack.push(push_search_record(csr_next[e], csr_route[e], crnt, csr_length[e]));
         }
 
     }
@@ -721,66 +1817,112 @@ std::vector<std::tuple<StopID, RouteID, Distance>> Datastructures::journey_with_
     return {};
 }
 
-class PriorityQueueDistComp {
-public:
-    bool operator() (std::tuple<StopID, std::vector<std::tuple<StopID, RouteID, Distance>>, Distance> i, std::tuple<StopID, std::vector<std::tuple<StopID, RouteID, Distance>>, Distance> j) {
-        return (std::get<2>(i) < std::get<2>(j));
-    }
-};
-
 std::vector<std::tuple<StopID, RouteID, Distance>> Datastructures::journey_shortest_distance(StopID fromstop, StopID tostop)
 {
     //If either of the stops isn't found.
-    if (stops.find(fromstop) == stops.end() || stops.find(tostop) == stops.end()) {return {{NO_STOP, NO_ROUTE, NO_DISTANCE}};}
+    StopIdx from = find_stop(fromstop);
+    StopIdx to = find_stop(tostop);
+    if (from == NO_INDEX || to == NO_INDEX) {return {{NO_STOP, NO_ROUTE, NO_DISTANCE}};}
     //If the starting stop is the same as the destination stop.
-    if (fromstop == tostop) {return {};}
+    if (from == to) {return {};}
 
-    std::priority_queue<std::tuple<StopID, std::vector<std::tuple<StopID, RouteID, Distance>>, Distance>, std::vector<std::tuple<StopID, std::vector<std::tuple<StopID, RouteID, Distance>>, Distance>>, PriorityQueueDistComp> thequeue;
+    //Dijkstra's algorithm with lazy deletion: a stop may be in the queue several times, but
+    //only the entry matching its best known distance is expanded.
+    //Min-heap of pairs (distance travelled, record index).
+    std::priority_queue<std::pair<Distance, int>, std::vector<std::pair<Distance, int>>, std::greater<std::pair<Distance, int>>> thequeue;
 
-    std::unordered_map<StopID, bool> visited;
-
-    thequeue.push(std::tuple<StopID, std::vector<std::tuple<StopID, RouteID, Distance>>, Distance>(fromstop, {}, 0));
+    start_labelled_search();
+    set_label(from, 0);
+    thequeue.push(std::pair<Distance, int>(0, push_search_record(from, NO_INDEX, -1, 0)));
 
     while (thequeue.size() != 0) {
 
-        auto popped = thequeue.top();
+        int crnt = thequeue.top().second;
         thequeue.pop();
 
-        StopID crntstop = std::get<0>(popped);
-        auto crntpath = std::get<1>(popped);
+        StopIdx crntstop = search_records[crnt].stop;
+
+        //Skip entries that have been superseded by a shorter path.
+        if (is_settled(crntstop)) {continue;}
+        settle(crntstop);
+
+        //The first time the destination is settled, its distance is final.
+        if (crntstop == to) {return rebuild_journey(crnt);}
+
+        Distance crntdist = search_records[crnt].dist;
+        auto relax = [&](StopIdx nextstop, RouteIdx route, Distance length) {
+            Distance nextdist = crntdist + length;
+            if (is_settled(nextstop) || nextdist >= get_label(nextstop)) {return;}
 
-        if (crntstop == tostop) {
-            StopID prevstop = std::get<0>(crntpath.back());
-            Distance nextdist = calc_dist(prevstop, tostop);
-            Distance prevdist = std::get<2>(crntpath.back());
-            crntpath.push_back(std::tuple<StopID, RouteID, Distance>(crntstop, NO_ROUTE, nextdist+prevdist));
-            return crntpath;
+            set_label(nextstop, nextdist);
+            thequeue.push(std::pair<Distance, int>(nextdist, push_search_record(nextstop, route, crnt, length)));
+        };
+
+        for (std::uint32_t e=csr_offsets[crntstop]; e<csr_offsets[crntstop+1]; e++) { //O(elog(v)) in total
+            relax(csr_next[e], csr_route[e], csr_length[e]);
+        }
+        for (std::uint32_t e=walk_offsets[crntstop]; e<walk_offsets[crntstop+1]; e++) {
+            relax(walk_next[e], WALK_INDEX, walk_length[e]);
         }
+    }
 
-        visited[crntstop] = true;
+    return {};
+}
+
+std::vector<std::tuple<StopID, RouteID, Distance>> Datastructures::journey_shortest_distance_astar(StopID fromstop, StopID tostop)
+{
+    //If either of the stops isn't found.
+    StopIdx from = find_stop(fromstop);
+    StopIdx to = find_stop(tostop);
+    if (from == NO_INDEX || to == NO_INDEX) {return {{NO_STOP, NO_ROUTE, NO_DISTANCE}};}
+    //If the starting stop is the same as the destination stop.
+    if (from == to) {return {};}
+
+    start_labelled_search();
+
+    //A* search: like journey_shortest_distance, but the queue is ordered by the distance
+    //travelled plus a lower bound for the distance still left. The bound is the straight
+    //line distance to the destination scaled by heuristic_scale, which keeps it below the
+    //truncated edge lengths, so the first time the destination is settled its distance is
+    //still the shortest one.
+    Coord target = stop_coords[to];
+    auto estimate = [this, target](StopIdx stop) {
+        return heuristic_scale * std::hypot(stop_coords[stop].x-target.x, stop_coords[stop].y-target.y);
+    };
 
-        auto successors = routes_from(crntstop);
+    //Min-heap of pairs (estimated total distance, record index).
+    std::priority_queue<std::pair<double, int>, std::vector<std::pair<double, int>>, std::greater<std::pair<double, int>>> thequeue;
 
-        for (auto it=successors.begin(); it!=successors.end(); it++) {
-            if (visited[it->second] == true) {continue;}
+    set_label(from, 0);
+    thequeue.push(std::pair<double, int>(estimate(from), push_search_record(from, NO_INDEX, -1, 0)));
 
-            RouteID nextroute = it->first;
-            StopID nextstop = it->second;
-            Distance prevdist, nextdist;
+    while (thequeue.size() != 0) {
 
-            if (crntpath.size()==0) {prevdist=0; nextdist=0;}
-            else {
-                prevdist = std::get<2>(crntpath.back());
-                StopID prevstop = std::get<0>(crntpath.back());
-                nextdist = calc_dist(prevstop, crntstop);
-            }
+        int crnt = thequeue.top().second;
+        thequeue.pop();
+
+        StopIdx crntstop = search_records[crnt].stop;
+
+        //Skip entries that have been superseded by a shorter path.
+        if (is_settled(crntstop)) {continue;}
+        settle(crntstop);
+
+        if (crntstop == to) {return rebuild_journey(crnt);}
 
-            Distance cost = calc_dist(crntstop, nextstop) + nextdist + prevdist;
+        Distance crntdist = search_records[crnt].dist;
+        auto relax = [&](StopIdx nextstop, RouteIdx route, Distance length) {
+            Distance nextdist = crntdist + length;
+            if (is_settled(nextstop) || nextdist >= get_label(nextstop)) {return;}
 
-            auto newpath = crntpath;
+            set_label(nextstop, nextdist);
+            thequeue.push(std::pair<double, int>(nextdist + estimate(nextstop), push_search_record(nextstop, route, crnt, length)));
+        };
 
-            newpath.push_back(std::tuple<StopID, RouteID, Distance>(crntstop, nextroute, prevdist+nextdist));
-            thequeue.push(std::tuple<StopID, std::vector<std::tuple<StopID, RouteID, Distance>>, Distance>(nextstop, newpath, cost));
+        for (std::uint32_t e=csr_offsets[crntstop]; e<csr_offsets[crntstop+1]; e++) { //O(elog(v)) in the worst case
+            relax(csr_next[e], csr_route[e], csr_length[e]);
+        }
+        for (std::uint32_t e=walk_offsets[crntstop]; e<walk_offsets[crntstop+1]; e++) {
+            relax(walk_next[e], WALK_INDEX, walk_length[e]);
         }
     }
 
@@ -789,117 +1931,415 @@ std::vector<std::tuple<StopID, RouteID, Distance>> Datastructures::journey_short
 
 bool Datastructures::add_trip(RouteID routeid, std::vector<Time> const& stop_times)
 {
-    if (routes.find(routeid) == routes.end()) {return false;}
+    RouteIdx route = find_route(routeid);
+    if (route == NO_INDEX) {return false;}
+    //Every stop of the route needs a time.
+    if (stop_times.size() != route_stop_lists[route].size()) {return false;}
+
+    //The trip goes after the trips leaving the first stop at the same time or earlier, so
+    //trips added in the order of departure are simply appended to the columns.
+    Timetable& columns = route_times[route];
+    auto place = std::upper_bound(columns.front().begin(), columns.front().end(), stop_times.front());
+    std::size_t pos = std::distance(columns.front().begin(), place);
+    for (std::size_t i=0; i<columns.size(); i++) { //O(k*t) at worst, O(k) when appending
+        columns[i].insert(columns[i].begin()+pos, stop_times[i]);
+    }
 
-    trips[routeid].push_back(stop_times);
+    timetable_stale = true;
     return true;
 }
 
 std::vector<std::pair<Time, Duration>> Datastructures::route_times_from(RouteID routeid, StopID stopid)
 {
-    if (routes.find(routeid) == routes.end()) {return {{NO_TIME, NO_DURATION}};}
-    if (stops.find(stopid) == stops.end()) {return {{NO_TIME, NO_DURATION}};}
-    if (trips.find(routeid) == trips.end()) {return {{NO_TIME, NO_DURATION}};}
+    RouteIdx route = find_route(routeid);
+    if (route == NO_INDEX) {return {{NO_TIME, NO_DURATION}};}
+    if (find_stop(stopid) == NO_INDEX) {return {{NO_TIME, NO_DURATION}};}
 
-
-    std::vector<StopID> routestops = routes[routeid];
-    auto it = std::find(routestops.begin(), --routestops.end(), stopid);
+    std::vector<StopID>& routestops = route_stop_lists[route];
+    auto last = std::prev(routestops.end());
+    auto it = std::find(routestops.begin(), last, stopid);
 
     //If the stop is not on the route or it's the last stop.
-    if (it == routestops.end()) {return {{NO_TIME, NO_DURATION}};}
+    if (it == last) {return {{NO_TIME, NO_DURATION}};}
 
-    int idx = std::distance(routestops.begin(), it);
+    std::size_t idx = std::distance(routestops.begin(), it);
+    std::pmr::vector<Time> const& departures = route_times[route][idx];
+    std::pmr::vector<Time> const& arrivals = route_times[route][idx+1];
+    if (departures.empty()) {return {{NO_TIME, NO_DURATION}};}
 
     std::vector<std::pair<Time, Duration>> return_vector;
-
-    for (auto &times : trips[routeid]) {
-        Time departure = times[idx];
-        Duration duration = times[idx+1] - times[idx];
-        return_vector.push_back(std::pair<Time, Duration>(departure, duration));
+    return_vector.reserve(departures.size());
+    for (std::size_t t=0; t<departures.size(); t++) { //O(t)
+        return_vector.push_back(std::pair<Time, Duration>(departures[t], arrivals[t] - departures[t]));
     }
 
     return return_vector;
 }
 
-class PriorityQueueDurComp {
-public:
-    bool operator() (std::pair<StopID, std::vector<std::tuple<StopID, RouteID, Time>>> i, std::pair<StopID, std::vector<std::tuple<StopID, RouteID, Time>>> j) {
-        return std::get<2>(i.second.back()) < std::get<2>(j.second.back());
+void Datastructures::build_timetable()
+{
+    pattern_route.clear();
+    pattern_stop_offsets.assign(1, 0);
+    pattern_stops.clear();
+    pattern_time_offsets.assign(1, 0);
+    pattern_times.clear();
+    pattern_trip_offsets.assign(1, 0);
+
+    for (RouteIdx r=0; r<route_ids.size(); r++) { //O(t*k) in total, t is the number of trips and k the length of a route
+        Timetable const& timetable = route_times[r];
+        if (timetable.front().empty()) {continue;}
+
+        std::vector<StopIdx> stops;
+        for (StopID stop : route_stop_lists[r]) {stops.push_back(find_stop(stop));}
+
+        //The trips are in the order of departure from the first stop already. The times at
+        //each stop of a pattern have to be in ascending order for the binary search, so a
+        //trip that would overtake the latest trip of every pattern so far starts a new one.
+        std::vector<std::vector<std::uint32_t>> groups;
+        for (std::uint32_t t=0; t<timetable.front().size(); t++) {
+            auto fits = [&](std::vector<std::uint32_t> const& group) {
+                for (auto const& column : timetable) {
+                    if (column[t] < column[group.back()]) {return false;}
+                }
+                return true;
+            };
+            auto group = std::find_if(groups.begin(), groups.end(), fits);
+            if (group == groups.end()) {groups.push_back({t});}
+            else {group->push_back(t);}
+        }
+
+        for (auto &group : groups) {
+            pattern_route.push_back(r);
+            pattern_stops.insert(pattern_stops.end(), stops.begin(), stops.end());
+            pattern_stop_offsets.push_back(pattern_stops.size());
+            for (auto const& column : timetable) {
+                for (std::uint32_t t : group) {pattern_times.push_back(column[t]);}
+            }
+            pattern_time_offsets.push_back(pattern_times.size());
+            pattern_trip_offsets.push_back(pattern_trip_offsets.back() + group.size());
+        }
     }
-};
+
+    //For each stop, the patterns passing it and the position of the stop on them.
+    stop_pattern_offsets.assign(stop_ids.size()+1, 0);
+    for (StopIdx stop : pattern_stops) {stop_pattern_offsets[stop+1]++;}
+    std::partial_sum(stop_pattern_offsets.begin(), stop_pattern_offsets.end(), stop_pattern_offsets.begin());
+    stop_patterns.resize(pattern_stops.size());
+    std::vector<std::uint32_t> fill(stop_pattern_offsets.begin(), std::prev(stop_pattern_offsets.end()));
+    for (std::uint32_t p=0; p<pattern_route.size(); p++) { //O(s), s is the total length of the patterns
+        for (std::uint32_t i=pattern_stop_offsets[p]; i<pattern_stop_offsets[p+1]; i++) {
+            stop_patterns[fill[pattern_stops[i]]++] = {p, i-pattern_stop_offsets[p]};
+        }
+    }
+
+    //Every trip between two consecutive stops as one connection, in the order of departure.
+    connections.clear();
+    for (std::uint32_t p=0; p<pattern_route.size(); p++) { //O(c*log(c)), c is the number of connections
+        std::uint32_t length = pattern_stop_offsets[p+1] - pattern_stop_offsets[p];
+        std::uint32_t trip_count = pattern_trip_offsets[p+1] - pattern_trip_offsets[p];
+        Time const* times = &pattern_times[pattern_time_offsets[p]];
+        for (std::uint32_t i=0; i+1<length; i++) {
+            for (std::uint32_t t=0; t<trip_count; t++) {
+                connections.push_back({pattern_stops[pattern_stop_offsets[p]+i], pattern_stops[pattern_stop_offsets[p]+i+1],
+                                       times[i*trip_count+t], times[(i+1)*trip_count+t], p, t, i});
+            }
+        }
+    }
+    std::sort(connections.begin(), connections.end(), [](Connection const& a, Connection const& b) {
+        return std::tie(a.departure, a.arrival, a.pos) < std::tie(b.departure, b.arrival, b.pos);
+    });
+
+    timetable_stale = false;
+}
 
 std::vector<std::tuple<StopID, RouteID, Time>> Datastructures::journey_earliest_arrival(StopID fromstop, StopID tostop, Time starttime)
 {
     //If either of the stops isn't found.
-    if (stops.find(fromstop) == stops.end() || stops.find(tostop) == stops.end()) {return {{NO_STOP, NO_ROUTE, NO_DISTANCE}};}
+    StopIdx from = find_stop(fromstop);
+    StopIdx to = find_stop(tostop);
+    if (from == NO_INDEX || to == NO_INDEX) {return {{NO_STOP, NO_ROUTE, NO_DISTANCE}};}
     //If the starting stop is the same as the destination stop.
-    if (fromstop == tostop) {return {};}
-    //Flag to mark the first stop
-    bool flag = false;
-
-    std::priority_queue<std::pair<StopID, std::vector<std::tuple<StopID, RouteID, Time>>>, std::vector<std::pair<StopID, std::vector<std::tuple<StopID, RouteID, Distance>>>>, PriorityQueueDurComp> thequeue;
-
-    std::unordered_map<StopID, bool> visited;
-
-    thequeue.push(std::pair<StopID, std::vector<std::tuple<StopID, RouteID, Time>>>(fromstop, {}));
+    if (from == to) {return {};}
+
+    if (timetable_stale) {build_timetable();}
+
+    //RAPTOR: round k finds the earliest arrivals using k trips. Each round scans the
+    //patterns passing the stops improved in the previous round, once each, starting from
+    //the earliest such stop. On the way along a pattern the journey can get off at every
+    //stop and switch to an earlier trip wherever one can be caught. After the trips, the
+    //round walks from the stops the trips reached to the stops nearby.
+    //The labels hold the index of the latest arrival record of each stop.
+    start_labelled_search();
+    arrival_records.clear();
+    auto arrival = [this](StopIdx stop) {
+        if (label_stamp[stop] != search_stamp) {return std::numeric_limits<Time>::max();}
+        return arrival_records[label_dist[stop]].arrival;
+    };
+    if (ride_stamp.size() != stop_ids.size()) {ride_stamp.assign(stop_ids.size(), 0);}
+    ride_label.resize(stop_ids.size());
+    auto ride = [this](StopIdx stop) {
+        if (ride_stamp[stop] != search_stamp) {return std::numeric_limits<Time>::max();}
+        return arrival_records[ride_label[stop]].arrival;
+    };
 
-    while (thequeue.size() != 0) {
+    std::vector<StopIdx> marked; //Stops improved in the latest round.
+    std::vector<StopIdx> ridden; //Stops reached by a trip in the latest round.
+    //Records the arrival to a stop, marking the stop if it's the first improvement of the round.
+    auto improve = [&](StopIdx stop, ArrivalRecord const& record) {
+        if (label_stamp[stop] != search_stamp || arrival_records[label_dist[stop]].round != record.round) {marked.push_back(stop);}
+        arrival_records.push_back(record);
+        set_label(stop, arrival_records.size()-1);
+    };
+    //Walks from the stop of record r to the stops nearby.
+    auto walk = [&](int r) {
+        StopIdx stop = arrival_records[r].stop;
+        for (std::uint32_t e=walk_offsets[stop]; e<walk_offsets[stop+1]; e++) {
+            Time t = arrival_records[r].arrival + walk_time[e];
+            if (t >= arrival(walk_next[e]) || t >= arrival(to)) {continue;}
+            improve(walk_next[e], {walk_next[e], NO_INDEX, NO_INDEX, 0, 0, r, t, arrival_records[r].round});
+        }
+    };
 
-        auto popped = thequeue.top();
-        thequeue.pop();
+    improve(from, {from, NO_INDEX, NO_INDEX, 0, 0, -1, starttime, 0});
+    walk(0);
 
-        StopID crntstop = popped.first;
-        auto crntpath = popped.second;
+    std::vector<std::uint32_t> first_pos(pattern_route.size(), NO_INDEX);
+    std::vector<std::uint32_t> scanned;
 
-        if (crntstop == tostop) {
-            StopID prevstop = std::get<0>(crntpath.back());
-            RouteID prevroute = std::get<1>(crntpath.back());
-            std::vector<StopID> routestops = routes[prevroute];
+    for (std::uint32_t round=1; marked.size() != 0; round++) {
 
-            auto it = std::find(routestops.begin(), routestops.end(), prevstop);
-            int idx = std::distance(routestops.begin(), it);
-            Time t = route_times_from(prevroute, prevstop)[idx].first + route_times_from(prevroute, prevstop)[idx].second;
+        scanned.clear();
+        for (StopIdx stop : marked) {
+            for (std::uint32_t e=stop_pattern_offsets[stop]; e<stop_pattern_offsets[stop+1]; e++) {
+                auto [p, pos] = stop_patterns[e];
+                if (first_pos[p] == NO_INDEX) {scanned.push_back(p);}
+                first_pos[p] = std::min(first_pos[p], pos);
+            }
+        }
+        marked.clear();
+        ridden.clear();
+
+        for (std::uint32_t p : scanned) {
+            std::uint32_t length = pattern_stop_offsets[p+1] - pattern_stop_offsets[p];
+            std::uint32_t trip_count = pattern_trip_offsets[p+1] - pattern_trip_offsets[p];
+            Time const* times = &pattern_times[pattern_time_offsets[p]];
+
+            std::uint32_t trip = NO_INDEX;
+            std::uint32_t board_pos = 0;
+            int board = -1;
+
+            for (std::uint32_t i=first_pos[p]; i<length; i++) {
+                StopIdx stop = pattern_stops[pattern_stop_offsets[p]+i];
+
+                //Get off here if it's the earliest arrival to the stop by a trip so far and it
+                //can still improve the arrival to the destination. Unless it's the earliest
+                //arrival of all, it's only kept for walking on.
+                if (trip != NO_INDEX) {
+                    Time t = times[i*trip_count+trip];
+                    if (t < ride(stop) && t < arrival(to)) {
+                        ArrivalRecord record = {stop, p, trip, board_pos, i, board, t, round};
+                        if (t < arrival(stop)) {improve(stop, record);}
+                        else {arrival_records.push_back(record);}
+                        if (ride_stamp[stop] != search_stamp || arrival_records[ride_label[stop]].round != round) {ridden.push_back(stop);}
+                        ride_stamp[stop] = search_stamp;
+                        ride_label[stop] = arrival_records.size()-1;
+                    }
+                }
 
-            crntpath.push_back(std::tuple<StopID, RouteID, Distance>(crntstop, NO_ROUTE, t));
-            return crntpath;
+                //Switch to the earliest trip that can be caught here, if it's earlier than the current one.
+                Time reached = arrival(stop);
+                if (reached == std::numeric_limits<Time>::max()) {continue;}
+                Time const* column = times + i*trip_count;
+                std::uint32_t limit = (trip == NO_INDEX) ? trip_count : trip;
+                std::uint32_t earliest = std::lower_bound(column, column+limit, reached) - column; //O(log(t))
+                if (earliest < limit) {
+                    trip = earliest;
+                    board_pos = i;
+                    board = label_dist[stop];
+                }
+            }
+            first_pos[p] = NO_INDEX;
         }
 
-        visited[crntstop] = true;
+        for (StopIdx stop : ridden) {walk(ride_label[stop]);}
+    }
 
-        auto successor_routes = routes_from(crntstop);
-        std::vector<std::tuple<Time, Duration, RouteID, StopID>> successor_trips;
+    if (label_stamp[to] != search_stamp) {return {};}
+    return rebuild_arrivals(label_dist[to]);
+}
 
-        for (auto &rs : successor_routes) {
-            auto route_trips = route_times_from(rs.first, crntstop);
-            if (route_trips == std::vector<std::pair<Time, Duration>>({{NO_TIME, NO_DURATION}})) {continue;}
+std::vector<std::tuple<StopID, RouteID, Time>> Datastructures::journey_earliest_arrival_csa(StopID fromstop, StopID tostop, Time starttime)
+{
+    //If either of the stops isn't found.
+    StopIdx from = find_stop(fromstop);
+    StopIdx to = find_stop(tostop);
+    if (from == NO_INDEX || to == NO_INDEX) {return {{NO_STOP, NO_ROUTE, NO_DISTANCE}};}
+    //If the starting stop is the same as the destination stop.
+    if (from == to) {return {};}
+
+    if (timetable_stale) {build_timetable();}
+
+    //Connection scan: the connections are scanned once in the order of departure, starting
+    //from the first one leaving at or after the start time. A connection can be used if its
+    //trip has been boarded already or its departure stop has been reached by then. The scan
+    //ends when the connections leave after the arrival to the destination. Whenever a trip
+    //reaches a stop earlier than any trip before, the journey can also walk on from there.
+    //The labels hold the index of the latest arrival record of each stop, and every trip that
+    //has been boarded has the record of the stop where it was boarded.
+    start_labelled_search();
+    arrival_records.clear();
+    auto arrival = [this](StopIdx stop) {
+        if (label_stamp[stop] != search_stamp) {return std::numeric_limits<Time>::max();}
+        return arrival_records[label_dist[stop]].arrival;
+    };
 
-            for (auto &td : route_trips) {
-                if ((td.first >= starttime && td.first <= starttime + 20*60) || flag==true) {
-                    successor_trips.push_back(std::tuple<Time, Duration, RouteID, StopID>(td.first, td.second, rs.first, rs.second));
-                }
-            }
+    //The trip stamps are cleared together with the labels.
+    std::uint32_t trip_count = pattern_trip_offsets.back();
+    if (trip_stamp.size() != trip_count) {trip_stamp.assign(trip_count, 0);}
+    trip_board.resize(trip_count);
+    trip_board_pos.resize(trip_count);
+    if (ride_stamp.size() != stop_ids.size()) {ride_stamp.assign(stop_ids.size(), 0);}
+    ride_label.resize(stop_ids.size());
+    auto ride = [this](StopIdx stop) {
+        if (ride_stamp[stop] != search_stamp) {return std::numeric_limits<Time>::max();}
+        return arrival_records[ride_label[stop]].arrival;
+    };
+    //Walks from the stop of record r to the stops nearby.
+    auto walk = [&](int r) {
+        StopIdx stop = arrival_records[r].stop;
+        for (std::uint32_t e=walk_offsets[stop]; e<walk_offsets[stop+1]; e++) {
+            Time t = arrival_records[r].arrival + walk_time[e];
+            if (t >= arrival(walk_next[e])) {continue;}
+            arrival_records.push_back({walk_next[e], NO_INDEX, NO_INDEX, 0, 0, r, t, 0});
+            set_label(walk_next[e], arrival_records.size()-1);
         }
+    };
+
+    arrival_records.push_back({from, NO_INDEX, NO_INDEX, 0, 0, -1, starttime, 0});
+    set_label(from, 0);
+    walk(0);
 
-        flag = true;
+    auto first = std::partition_point(connections.begin(), connections.end(), [starttime](Connection const& c) {return c.departure < starttime;});
+    for (auto c=first; c!=connections.end(); c++) { //O(c)
+        if (c->departure >= arrival(to)) {break;}
 
-        for (auto it=successor_trips.begin(); it!=successor_trips.end(); it++) {
-            if (visited[std::get<3>(*it)] == true) {continue;}
-            //Prevent journeys spanning midnight.
-            if (crntpath.size()!=0 && std::get<0>(*it) <= std::get<2>(crntpath.back())) {continue;}
+        std::uint32_t trip = pattern_trip_offsets[c->pattern] + c->trip;
+        if (trip_stamp[trip] != search_stamp) {
+            if (arrival(c->from) > c->departure) {continue;}
+            trip_stamp[trip] = search_stamp;
+            trip_board[trip] = label_dist[c->from];
+            trip_board_pos[trip] = c->pos;
+        }
 
-            RouteID nextroute = std::get<2>(*it);
-            StopID nextstop = std::get<3>(*it);
+        if (c->arrival < ride(c->to)) {
+            arrival_records.push_back({c->to, c->pattern, c->trip, trip_board_pos[trip], c->pos+1, trip_board[trip], c->arrival, 0});
+            ride_stamp[c->to] = search_stamp;
+            ride_label[c->to] = arrival_records.size()-1;
+            if (c->arrival < arrival(c->to)) {set_label(c->to, arrival_records.size()-1);}
+            walk(arrival_records.size()-1);
+        }
+    }
 
-            auto newpath = crntpath;
+    if (label_stamp[to] != search_stamp) {return {};}
+    return rebuild_arrivals(label_dist[to]);
+}
 
-            newpath.push_back(std::tuple<StopID, RouteID, Time>(crntstop, nextroute, std::get<0>(*it)));
-            thequeue.push(std::pair<StopID, std::vector<std::tuple<StopID, RouteID, Time>>>(nextstop, newpath));
+std::vector<std::tuple<StopID, RouteID, Time>> Datastructures::rebuild_arrivals(int last)
+{
+    //Walk the records back to the start. Every leg lists the stops from where the trip
+    //was boarded up to the stop before getting off, with the departure times.
+    std::vector<std::tuple<StopID, RouteID, Time>> journey;
+    journey.push_back(std::tuple<StopID, RouteID, Time>(stop_ids[arrival_records[last].stop], NO_ROUTE, arrival_records[last].arrival));
+    for (int r=last; arrival_records[r].prev != -1; r=arrival_records[r].prev) {
+        ArrivalRecord const& leg = arrival_records[r];
+        //A walk leaves as soon as the stop it starts from is reached.
+        if (leg.pattern == NO_INDEX) {
+            ArrivalRecord const& start = arrival_records[leg.prev];
+            journey.push_back(std::tuple<StopID, RouteID, Time>(stop_ids[start.stop], WALK_ROUTE, start.arrival));
+            continue;
+        }
+        std::uint32_t trip_count = pattern_trip_offsets[leg.pattern+1] - pattern_trip_offsets[leg.pattern];
+        Time const* times = &pattern_times[pattern_time_offsets[leg.pattern]];
+        for (std::uint32_t i=leg.alight; i-- > leg.board;) {
+            StopIdx stop = pattern_stops[pattern_stop_offsets[leg.pattern]+i];
+            journey.push_back(std::tuple<StopID, RouteID, Time>(stop_ids[stop], route_ids[pattern_route[leg.pattern]], times[i*trip_count+leg.trip]));
         }
     }
+    std::reverse(journey.begin(), journey.end());
 
-    return {};
+    return journey;
 }
 
 void Datastructures::add_walking_connections()
 {
+    if (walking && !walks_stale) {return;}
+    walking = true;
+    build_walks(); //O(n+w), w is the number of walks
+}
+
+void Datastructures::set_walking_radius(Distance radius)
+{
+    walking_radius = radius;
+    walks_stale = true;
+}
+
+void Datastructures::build_walks()
+{
+    StopIdx n = stop_ids.size();
+    walk_offsets.assign(n+1, 0);
+    walk_next.clear();
+    walk_length.clear();
+    walk_time.clear();
+
+    if (walking) {
+        //A uniform grid of cells as wide as the radius, so the stops within the radius of a
+        //stop are all in its own cell or the eight cells around it. The stops are sorted by
+        //their cells, and the hash map gives the range of each cell in the sorted order.
+        long int cell = std::max(walking_radius, 1);
+        auto key = [cell](Coord xy, long int dx, long int dy) {
+            long int x = xy.x / cell - (xy.x % cell < 0) + dx;
+            long int y = xy.y / cell - (xy.y % cell < 0) + dy;
+            return (static_cast<std::uint64_t>(x) << 32) ^ static_cast<std::uint32_t>(y);
+        };
+        std::vector<std::pair<std::uint64_t, KdPoint>> by_cell(n);
+        for (StopIdx i=0; i<n; i++) {by_cell[i] = {key(stop_coords[i], 0, 0), {stop_coords[i], i}};}
+        std::sort(by_cell.begin(), by_cell.end(), [](auto const& a, auto const& b) {
+            return std::tie(a.first, a.second.stop) < std::tie(b.first, b.second.stop);
+        }); //O(nlog(n))
+        std::unordered_map<std::uint64_t, std::pair<StopIdx, StopIdx>> grid;
+        for (StopIdx i=0; i<n; i++) { //O(n)
+            auto range = grid.insert({by_cell[i].first, {i, i}}).first;
+            range->second.second = i+1;
+        }
+
+        long int limit = static_cast<long int>(walking_radius)*walking_radius;
+        for (StopIdx i=0; i<n; i++) { //O(n+w) if the stops are spread evenly, w is the number of walks
+            walk_offsets[i] = walk_next.size();
+            Coord xy = stop_coords[i];
+            for (long int dx=-1; dx<=1; dx++) {
+                for (long int dy=-1; dy<=1; dy++) {
+                    auto range = grid.find(key(xy, dx, dy));
+                    if (range == grid.end()) {continue;}
+                    for (StopIdx c=range->second.first; c<range->second.second; c++) {
+                        StopIdx j = by_cell[c].second.stop;
+                        long int ddx = by_cell[c].second.xy.x - xy.x;
+                        long int ddy = by_cell[c].second.xy.y - xy.y;
+                        long int squared = ddx*ddx + ddy*ddy;
+                        if (j == i || squared > limit) {continue;}
+
+                        double straight = std::sqrt(squared);
+                        Distance length = straight;
+                        walk_next.push_back(j);
+                        walk_length.push_back(length);
+                        walk_time.push_back((static_cast<long int>(length)*60 + WALKING_SPEED-1) / WALKING_SPEED);
+                        //As in lower_heuristic_scale, with the straight line distance at hand.
+                        if (straight > 0) {heuristic_scale = std::min(heuristic_scale, length/straight*(1-1e-9));}
+                    }
+                }
+            }
+        }
+    }
+    walk_offsets[n] = walk_next.size();
+
+    walks_stale = false;
 }
@@ -11,6 +11,10 @@
 #include <unordered_map>
 #include <list>
 #include <algorithm>
+#include <cstdint>
+#include <set>
+#include <string_view>
+#include <memory_resource>
 
 // Types for IDs
 using StopID = long int;
@@ -20,6 +24,8 @@ using Name = std::string;
 
 // Return values for cases where required thing was not found
 RouteID const NO_ROUTE = "!!NO_ROUTE!!";
+// Route of the legs of a journey that are walked
+RouteID const WALK_ROUTE = "(walk)";
 StopID const NO_STOP = -1;
 RegionID const NO_REGION = "!!NO_REGION!!";
 
@@ -53,13 +59,13 @@ inline bool operator<(Coord c1, Coord c2)
 // Return value for cases where coordinates were not found
 Coord const NO_COORD = {NO_VALUE, NO_VALUE};
 
-// Type for time of day in minutes from midnight (i.e., 60*hours + minutes)
+// Type for time of day in seconds from midnight (i.e., 3600*hours + 60*minutes + seconds)
 using Time = int;
 
 // Return value for cases where color was not found
 Time const NO_TIME = std::numeric_limits<Time>::min();
 
-// Type for a duration of time (in minutes)
+// Type for a duration of time (in seconds)
 using Duration = int;
 
 // Return value for cases where Duration is unknown
@@ -71,20 +77,30 @@ using Distance = int;
 // Return value for cases where Duration is unknown
 Distance const NO_DISTANCE = NO_VALUE;
 
+//Dense index of a stop in the stop vectors of Datastructures.
+using StopIdx = std::uint32_t;
+
+//Dense index of a route in the route vectors of Datastructures.
+using RouteIdx = std::uint32_t;
+//Dense index of a region in the region vector of Datastructures.
+using RegionIdx = std::uint32_t;
+
+//Handle of an interned stop name.
+using NameIdx = std::uint32_t;
+//Index value for cases where a stop, a route or a region was not found.
+std::uint32_t const NO_INDEX = std::numeric_limits<std::uint32_t>::max();
+
 struct Region {
     RegionID id;
     Name name;
-    RegionID parent; //Parent region.
-    std::vector<RegionID> children; //The subregions belonging directly to that region.
+    std::vector<RegionIdx> children; //The subregions belonging directly to that region.
     std::vector<StopID> region_stops; //The stops belonging directly to that region.
-};
-
-struct Stop {
-    StopID id;
-    Name name;
-    Coord location;
-    RegionID parent; //Parent region.
-    std::unordered_map<RouteID, StopID> routes_out; //Routes going out from this stop and the next stop on that route.
+    //Bounding box and number of the stops within the region and its subregions. A box that
+    //may have shrunk is marked stale and recomputed only when it is asked for.
+    Coord box_min = NO_COORD;
+    Coord box_max = NO_COORD;
+    std::uint32_t stop_count = 0;
+    bool box_stale = false;
 };
 
 
@@ -102,12 +118,14 @@ public:
     bool add_stop(StopID id, Name const& name, Coord xy);
     Name get_stop_name(StopID id);
     Coord get_stop_coord(StopID id);
-    std::vector<StopID> stops_alphabetically();
-    std::vector<StopID> stops_coord_order();
+    std::vector<StopID> const& stops_alphabetically();
+    std::vector<StopID> const& stops_coord_order();
     StopID min_coord();
     StopID max_coord();
 
     std::vector<StopID> find_stops(Name const& name);
+    std::vector<StopID> find_stops_prefix(Name const& prefix);
+    std::vector<StopID> find_stops_substring(Name const& part);
     bool change_stop_name(StopID id, Name const& newname);
     bool change_stop_coord(StopID id, Coord newcoord);
     bool add_region(RegionID id, Name const& name);
@@ -121,6 +139,8 @@ public:
     void creation_finished();
     std::pair<Coord, Coord> region_bounding_box(RegionID id);
     std::vector<StopID> stops_closest_to(StopID id);
+    std::vector<StopID> stops_nearest_k(Coord xy, unsigned int k);
+    std::vector<StopID> stops_within_radius(Coord xy, Distance radius);
     bool remove_stop(StopID id);
     RegionID stops_common_region(StopID id1, StopID id2);
 
@@ -135,34 +155,375 @@ public:
     std::vector<std::tuple<StopID, RouteID, Distance>> journey_least_stops(StopID fromstop, StopID tostop);
     std::vector<std::tuple<StopID, RouteID, Distance>> journey_with_cycle(StopID fromstop);
     std::vector<std::tuple<StopID, RouteID, Distance>> journey_shortest_distance(StopID fromstop, StopID tostop);
+    std::vector<std::tuple<StopID, RouteID, Distance>> journey_shortest_distance_astar(StopID fromstop, StopID tostop);
+    //Number of stops settled by the latest shortest distance search.
+    int stops_settled();
 
     bool add_trip(RouteID routeid, const std::vector<Time> &stop_times);
     std::vector<std::pair<Time, Duration> > route_times_from(RouteID routeid, StopID stopid);
     std::vector<std::tuple<StopID, RouteID, Time>> journey_earliest_arrival(StopID fromstop, StopID tostop, Time starttime);
+    std::vector<std::tuple<StopID, RouteID, Time>> journey_earliest_arrival_csa(StopID fromstop, StopID tostop, Time starttime);
 
+    //Builds the walks, unless they are up to date already: calling it again before the stops
+    //or the radius change costs nothing.
     void add_walking_connections();
+    //Radius within which add_walking_connections connects the stops, 100 by default.
+    void set_walking_radius(Distance radius);
+
+    //Makes the data structures draw their memory from an arena or from the heap. Clears all data.
+    void set_arena(bool on);
+    //Bytes in use by each part of the data structures: stops, names, regions, routes,
+    //trips, sort caches and search state, in this order.
+    std::vector<std::pair<std::string, std::size_t>> memory_usage();
+    //Writes all the data, and the indexes that are kept up to date as it changes, into a
+    //binary file. False if the file can't be written.
+    bool save_snapshot(std::string const& filename);
+    //Replaces all the data with a snapshot written by save_snapshot, checking nothing but
+    //the format version and the checksum. False if the file can't be read or fails those
+    //checks, in which case everything is left cleared.
+    bool load_snapshot(std::string const& filename);
 
 private:
-    std::unordered_map<StopID, Stop> stops;
-    std::unordered_map<RegionID, Region> regions;
-
-    std::vector<StopID> sorted_alph;
-    std::vector<StopID> unsorted_alph;
-
-    std::vector<StopID> sorted_coord;
-    std::vector<StopID> unsorted_coord;
-
-    bool flag_alph=false;
-    bool flag_coord=false;
-
-    void get_region_subregions(RegionID id, std::vector<RegionID>& v);
-    std::list<StopID> get_all_region_stops(RegionID id);
-
-    void get_region_superregions(RegionID id, std::vector<RegionID>& v);
-
-    std::unordered_map<RouteID, std::vector<StopID>> routes;
-    std::unordered_map<RouteID, std::vector<std::vector<Time>>> trips;
-    Distance calc_dist(StopID a, StopID b);
+    //The memory of the node-based containers, the route edges and the timetables. It comes
+    //from the heap, or from a monotonic arena after set_arena(true). The arena only grows,
+    //and clear_all releases it all at once. Each resource counts the bytes it has handed out
+    //and not got back, so that memory_usage can tell the subsystems apart.
+    struct Memory : std::pmr::memory_resource {
+        std::pmr::memory_resource* upstream = std::pmr::new_delete_resource();
+        std::size_t live = 0;
+        void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+            void* p = upstream->allocate(bytes, alignment);
+            live += bytes;
+            return p;
+        }
+        void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override {
+            live -= bytes;
+            upstream->deallocate(p, bytes, alignment);
+        }
+        bool do_is_equal(std::pmr::memory_resource const& other) const noexcept override {return this == &other;}
+    };
+    std::pmr::monotonic_buffer_resource arena;
+    Memory stop_memory; //stop_index
+    Memory name_memory; //name_grams
+    Memory region_memory; //region_index
+    Memory route_memory; //route_index and the route edges
+    Memory trip_memory; //The timetables.
+    Memory order_memory; //alph_order and coord_order
+
+    //Every stop has a dense index into the stop vectors below. Removing a stop moves the
+    //last stop into the freed index, so the vectors stay contiguous.
+    std::pmr::unordered_map<StopID, StopIdx> stop_index{&stop_memory};
+    std::vector<StopID> stop_ids;
+    std::vector<NameIdx> stop_names;
+    std::vector<Coord> stop_coords;
+    std::vector<RegionIdx> stop_parents; //Parent region, NO_INDEX if there is none.
+    std::vector<std::uint32_t> stop_region_pos; //Position of the stop in the region_stops of its parent region.
+    //A route edge to a neighbouring stop, with the precomputed distance between the stops.
+    struct RouteEdge {
+        StopIdx stop;
+        Distance length;
+    };
+    //The route edges of a stop in the order they were added. A stop is on a few routes only,
+    //so an edge is found by a linear scan. A stop has at most one edge out per route, the
+    //first one if the route leaves the stop more than once, but a route coming back to the
+    //stop from a different stop adds another edge in.
+    using RouteEdges = std::pmr::vector<std::pair<RouteIdx, RouteEdge>>;
+    std::vector<RouteEdges> stop_routes_out; //Routes going out from the stop and the edge to the next stop on that route.
+    std::vector<RouteEdges> stop_routes_in; //Routes coming in to the stop and the edge from the previous stop on that route.
+    //The routes passing each stop, each route once. A route leaving the same stop twice
+    //keeps only the first edge out of it, so a stop can be on a route without an edge of
+    //that route.
+    std::vector<std::pmr::vector<RouteIdx>> stop_route_lists;
+
+    //The edge of the route, nullptr if there is none.
+    static RouteEdge* find_edge(RouteEdges& edges, RouteIdx route);
+    //The edge of the route to or from the given stop, nullptr if there is none.
+    static RouteEdge* find_edge(RouteEdges& edges, RouteIdx route, StopIdx stop);
+    //Erases all edges of the route.
+    static void erase_edge(RouteEdges& edges, RouteIdx route);
+
+    //Stop names are interned: each distinct name is stored once in name_chars, and the stops
+    //refer to it by handle. The text of handle h is name_chars[name_offsets[h] ... name_offsets[h+1]-1].
+    //name_table finds the handle of a text by open addressing with linear probing, NO_INDEX
+    //marking a free slot. It is kept at most half full.
+    std::string name_chars;
+    std::vector<std::uint32_t> name_offsets = {0};
+    std::vector<NameIdx> name_table;
+    //The number of stops with each name. A name that no stop has any more stays interned, so
+    //that it can be taken into use again, until there are more such names than stops.
+    std::vector<std::uint32_t> name_uses;
+    std::uint32_t names_unused = 0;
+
+    std::string_view name_text(NameIdx handle) const;
+    //Handle of the name for one more stop, interning the name if it is new.
+    NameIdx intern_name(Name const& name);
+    //One stop less has the name.
+    void drop_name(NameIdx handle);
+    //Handle of a name, NO_INDEX if it is not interned.
+    NameIdx find_name(std::string_view name);
+    void place_name(NameIdx handle);
+    //Drops the names that no stop has, renumbering the others in stop_names and alph_order. O(n)
+    void compact_names();
+    std::string_view stop_name(StopIdx idx) const {return name_text(stop_names[idx]);}
+
+    //Regions are numbered densely in the order they were added. They are never removed.
+    std::pmr::unordered_map<RegionID, RegionIdx> region_index{&region_memory};
+    std::vector<Region> regions;
+    //The parent and the depth of each region apart from the other region data, so that the
+    //ancestor chains are walked over compact arrays. A root has no parent and depth 0.
+    std::vector<RegionIdx> region_parents;
+    std::vector<std::uint32_t> region_depth;
+
+    RegionIdx find_region(RegionID id);
+
+    //Binary lifting over the region forest for stops_common_region: region_up[j][r] is the
+    //ancestor 2^j levels above region r, or the root of its tree if there is no such region.
+    //creation_finished builds the tables, and add_region and add_subregion_to_region keep
+    //them up to date once built.
+    std::vector<std::vector<RegionIdx>> region_up;
+    bool region_lca_built = false;
+
+    void build_region_lca();
+    //Recomputes the depths, and the tables if they are built, for the subtree of the given
+    //region after it got a new parent.
+    void update_region_depths(RegionIdx region);
+    //Lowest common ancestor of two regions, NO_INDEX if they are in different trees.
+    RegionIdx common_region(RegionIdx a, RegionIdx b);
+
+    //The stops in alphabetical order, the ID breaking ties. Every change updates the set in
+    //O(log(n)), and stops_alphabetically copies it into alph_ids only after a change.
+    //The set holds name handles, so equal names compare without looking at the text.
+    using NameKey = std::pair<NameIdx, StopID>;
+    //A bare text can be looked up too, and it goes before every stop with that name.
+    struct NameOrder {
+        using is_transparent = void;
+        Datastructures const* ds;
+        bool operator()(NameKey const& a, NameKey const& b) const {
+            if (a.first != b.first) {
+                int c = ds->name_text(a.first).compare(ds->name_text(b.first));
+                if (c != 0) {return c < 0;}
+            }
+            return a.second < b.second;
+        }
+        bool operator()(NameKey const& a, std::string_view b) const {return ds->name_text(a.first) < b;}
+        bool operator()(std::string_view a, NameKey const& b) const {return a <= ds->name_text(b.first);}
+    };
+    std::pmr::set<NameKey, NameOrder> alph_order{NameOrder{this}, &order_memory};
+    std::vector<StopID> alph_ids;
+    bool alph_stale = false;
+
+    //Trigram index of the stop names for find_stops_substring, built by the first search: the
+    //IDs of the stops whose names contain each sequence of three characters. Renaming or
+    //removing a stop leaves its old IDs in the lists, so the search checks every name it
+    //finds. The stale IDs are counted, and the index is rebuilt once they are the majority.
+    std::pmr::unordered_map<std::uint32_t, std::vector<StopID>> name_grams{&name_memory};
+    std::size_t name_grams_total = 0;
+    std::size_t name_grams_stale = 0;
+    bool name_grams_built = false;
+
+    static std::vector<std::uint32_t> name_gram_keys(std::string_view name);
+    void build_name_grams();
+    void add_name_grams(std::string_view name, StopID id);
+    void drop_name_grams(std::string_view name);
+
+    //The stops in coordinate order as (squared distance from the origin, y, ID), kept up to
+    //date like alph_order. A moved stop is repositioned in O(log(n)).
+    using CoordKey = std::tuple<long int, int, StopID>;
+    std::pmr::set<CoordKey> coord_order{&order_memory};
+    std::vector<StopID> coord_ids;
+    bool coord_stale = false;
+
+    StopIdx find_stop(StopID id);
+    //Squared distance from the origin.
+    static long int origin_dist(Coord c) {return static_cast<long int>(c.x)*c.x + static_cast<long int>(c.y)*c.y;}
+    CoordKey coord_key(StopIdx stop) {return CoordKey(origin_dist(stop_coords[stop]), stop_coords[stop].y, stop_ids[stop]);}
+
+    //A k-d tree of the stops for stops_closest_to. The median of each range of kd_points is
+    //in its middle, splitting the range by x on even depths and by y on odd ones. Stops added
+    //or moved after the tree was built wait in kd_extra, and the tree entries of moved and
+    //removed stops are left dead with NO_INDEX, until the next rebuild.
+    struct KdPoint {
+        Coord xy;
+        StopIdx stop;
+    };
+    std::vector<KdPoint> kd_points;
+    std::vector<StopIdx> kd_extra;
+    std::vector<std::uint32_t> kd_pos; //Position of each stop in kd_points, NO_INDEX if it's in kd_extra.
+    std::vector<std::uint32_t> kd_extra_pos; //Position of each stop in kd_extra, if it's there.
+    std::uint32_t kd_dead = 0;
+
+    void build_kd_tree();
+    void refresh_kd_tree();
+    void kd_build(std::uint32_t lo, std::uint32_t hi, bool by_y);
+
+    //A stop near a point as (squared distance, y, ID, index). The spatial queries order the
+    //stops by these, so equally distant stops come in the order of y and then ID.
+    using NearStop = std::tuple<long int, int, StopID, StopIdx>;
+    NearStop near_stop(StopIdx stop, Coord target);
+    std::vector<StopID> nearest_stops(Coord xy, std::size_t k, StopIdx skip);
+    //Offers the stops of range lo ... hi-1 of the tree to the k best stops closest to xy.
+    void kd_nearest(std::uint32_t lo, std::uint32_t hi, bool by_y, Coord xy, StopIdx skip,
+                    std::vector<NearStop>& best, std::size_t k);
+    static void kd_offer(NearStop const& candidate, std::vector<NearStop>& best, std::size_t k);
+    //Collects the stops of range lo ... hi-1 of the tree within the squared distance limit of xy.
+    void kd_within(std::uint32_t lo, std::uint32_t hi, bool by_y, Coord xy, long int limit, std::vector<NearStop>& found);
+
+    //Adds a stop at xy to the bounding boxes and stop counts of a region and its superregions.
+    void region_add_point(RegionIdx region, Coord xy);
+    //Takes a stop at xy out of them. The boxes that had the stop on their edge become stale.
+    void region_drop_point(RegionIdx region, Coord xy);
+    void refresh_region_box(RegionIdx region);
+
+    //Routes are numbered densely in the order they were added.
+    std::pmr::unordered_map<RouteID, RouteIdx> route_index{&route_memory};
+    std::vector<RouteID> route_ids;
+    std::vector<std::vector<StopID>> route_stop_lists;
+
+    RouteIdx find_route(RouteID id);
+    //Adds or drops the edges of a route to and from its stops.
+    void link_route(RouteIdx route);
+    void unlink_route(RouteIdx route);
+    //Removes an unlinked route, moving the last route into its index.
+    void remove_route(RouteIdx route);
+    //Puts the trips of a route back in the order of departure from the first stop.
+    void sort_trips(RouteIdx route);
+
+    //The timetable of each route column by column: route_times[r][i] has the times of all
+    //trips at the i:th stop of route r. add_trip keeps the trips in the order of departure
+    //from the first stop.
+    using Timetable = std::pmr::vector<std::pmr::vector<Time>>;
+    std::vector<Timetable> route_times;
+
+    //The trips frozen into patterns for journey_earliest_arrival. A pattern is a sequence of
+    //stops and a table of trips along it, column by column like route_times. Usually a
+    //route is one pattern, but if some of its trips overtake others, they are split into
+    //several patterns. The stops of pattern p are at positions pattern_stop_offsets[p] ...
+    //pattern_stop_offsets[p+1]-1 of pattern_stops and its times similarly in pattern_times.
+    std::vector<RouteIdx> pattern_route;
+    std::vector<std::uint32_t> pattern_stop_offsets;
+    std::vector<StopIdx> pattern_stops;
+    std::vector<std::uint32_t> pattern_time_offsets;
+    std::vector<Time> pattern_times;
+    //The trips of pattern p are numbered from pattern_trip_offsets[p] on.
+    std::vector<std::uint32_t> pattern_trip_offsets;
+    //The patterns passing stop i and the position of i on them are at positions
+    //stop_pattern_offsets[i] ... stop_pattern_offsets[i+1]-1 of stop_patterns.
+    std::vector<std::uint32_t> stop_pattern_offsets;
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> stop_patterns;
+    bool timetable_stale = true;
+
+    void build_timetable();
+
+    //One earliest arrival found by journey_earliest_arrival: the stop, the pattern and the
+    //trip that got there, the positions where the trip was boarded and left, the record of
+    //the boarding stop (-1 for the starting stop), the arrival time and the round.
+    struct ArrivalRecord {
+        StopIdx stop;
+        std::uint32_t pattern;
+        std::uint32_t trip;
+        std::uint32_t board;
+        std::uint32_t alight;
+        int prev;
+        Time arrival;
+        std::uint32_t round;
+    };
+    std::vector<ArrivalRecord> arrival_records;
+    std::vector<std::tuple<StopID, RouteID, Time>> rebuild_arrivals(int last);
+
+    //One leg of a trip between two consecutive stops of its pattern, for the connection scan.
+    //pos is the position of the departure stop on the pattern.
+    struct Connection {
+        StopIdx from;
+        StopIdx to;
+        Time departure;
+        Time arrival;
+        std::uint32_t pattern;
+        std::uint32_t trip;
+        std::uint32_t pos;
+    };
+    //All connections in the order of departure, built together with the patterns.
+    std::vector<Connection> connections;
+    //Trips boarded in the latest connection scan, stamped like the stop labels, with the
+    //record of the stop and the position where they were boarded.
+    std::vector<std::uint32_t> trip_stamp;
+    std::vector<int> trip_board;
+    std::vector<std::uint32_t> trip_board_pos;
+    //The latest arrival record of each stop reached by a trip rather than on foot, stamped
+    //like the labels. Walks only start from these, so a journey never walks twice in a row.
+    std::vector<std::uint32_t> ride_stamp;
+    std::vector<int> ride_label;
+    Distance calc_dist(StopIdx a, StopIdx b);
+
+    //The route network frozen into compressed sparse row form for the journey searches.
+    //The edges leaving stop i are at positions csr_offsets[i] ... csr_offsets[i+1]-1 of
+    //the other arrays. Any change to stops or routes marks it stale, and the next search
+    //rebuilds it.
+    std::vector<std::uint32_t> csr_offsets;
+    std::vector<StopIdx> csr_next;
+    std::vector<RouteIdx> csr_route;
+    std::vector<Distance> csr_length;
+    //The edges coming in to stop i are at positions csr_in_offsets[i] ... csr_in_offsets[i+1]-1.
+    std::vector<std::uint32_t> csr_in_offsets;
+    std::vector<StopIdx> csr_prev;
+    std::vector<RouteIdx> csr_in_route;
+    std::vector<Distance> csr_in_length;
+    bool csr_stale = true;
+
+    void build_csr();
+
+    //Walking connections between all stops within walking_radius of each other, once
+    //add_walking_connections has been called. The walks from stop i are at positions
+    //walk_offsets[i] ... walk_offsets[i+1]-1 of the other arrays. Like the CSR, they are
+    //marked stale by changes to the stops and rebuilt by the next search.
+    Distance walking_radius = 100;
+    bool walking = false;
+    std::vector<std::uint32_t> walk_offsets;
+    std::vector<StopIdx> walk_next;
+    std::vector<Distance> walk_length;
+    std::vector<Time> walk_time;
+    bool walks_stale = true;
+    //Walking speed in metres per minute.
+    static constexpr Distance WALKING_SPEED = 80;
+    //Route index of the walks in search records.
+    static constexpr RouteIdx WALK_INDEX = NO_INDEX-1;
+
+    void build_walks();
+    void set_csr_length(StopIdx from, RouteIdx route, Distance length);
+
+    //Smallest ratio of an edge length to the straight line distance between its stops.
+    //Edge lengths are truncated to whole metres, so the straight line distance alone could
+    //overestimate the rest of a journey. Coordinate changes only ever lower the ratio until
+    //the next rebuild, which keeps the A* heuristic safe.
+    double heuristic_scale = 1.0;
+    void lower_heuristic_scale(StopIdx a, StopIdx b, Distance length);
+
+    //One record of a journey search: the stop reached, the route used to get there,
+    //the record it was reached from (-1 for the starting stop) and the distance so far.
+    struct SearchRecord {
+        StopIdx stop;
+        RouteIdx route;
+        int prev;
+        Distance dist;
+    };
+    //Records of the latest search, reused between searches to avoid reallocating.
+    std::vector<SearchRecord> search_records;
+
+    int push_search_record(StopIdx stop, RouteIdx route, int prev, Distance length);
+
+    //Per-stop distance labels of the latest labelled search. A label belongs to the current
+    //search only if its stamp is search_stamp (reached) or search_stamp+1 (settled), so
+    //starting a new search doesn't need to clear the arrays.
+    std::vector<std::uint32_t> label_stamp;
+    std::vector<Distance> label_dist;
+    std::uint32_t search_stamp = 0;
+    int settled_count = 0;
+
+    void start_labelled_search();
+    Distance get_label(StopIdx stop);
+    void set_label(StopIdx stop, Distance dist);
+    bool is_settled(StopIdx stop);
+    void settle(StopIdx stop);
+    std::vector<std::tuple<StopID, RouteID, Distance>> rebuild_journey(int last);
 };
 
 
@@ -441,10 +441,58 @@ void MainProgram::test_stops_closest_to()
     if (random_stops_added_ > 0) // Don't do anything if there's no stops
     {
         auto id = n_to_id(random<decltype(random_stops_added_)>(0, random_stops_added_));
-        ds_.stop_regions(id);
+        ds_.stops_closest_to(id);
     }
 }
 
+MainProgram::CmdResult MainProgram::cmd_stops_nearest_k(std::ostream& output, MainProgram::MatchIter begin, MainProgram::MatchIter end)
+{
+    string xstr = *begin++;
+    string ystr = *begin++;
+    string kstr = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    int x = convert_string_to<int>(xstr);
+    int y = convert_string_to<int>(ystr);
+    unsigned int k = convert_string_to<unsigned int>(kstr);
+
+    auto result = ds_.stops_nearest_k({x, y}, k);
+    if (result.empty()) { output << "No stops found." << endl; }
+
+    return {ResultType::STOPIDLIST, CmdResultStopIDs{NO_REGION, result}};
+}
+
+void MainProgram::test_stops_nearest_k()
+{
+    auto x = random(0, 10000);
+    auto y = random(0, 10000);
+    ds_.stops_nearest_k({x, y}, random(1, 20));
+}
+
+MainProgram::CmdResult MainProgram::cmd_stops_within_radius(std::ostream& output, MainProgram::MatchIter begin, MainProgram::MatchIter end)
+{
+    string xstr = *begin++;
+    string ystr = *begin++;
+    string radiusstr = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    int x = convert_string_to<int>(xstr);
+    int y = convert_string_to<int>(ystr);
+    Distance radius = convert_string_to<Distance>(radiusstr);
+
+    auto result = ds_.stops_within_radius({x, y}, radius);
+    if (result.empty()) { output << "No stops found." << endl; }
+
+    return {ResultType::STOPIDLIST, CmdResultStopIDs{NO_REGION, result}};
+}
+
+void MainProgram::test_stops_within_radius()
+{
+    auto x = random(0, 10000);
+    auto y = random(0, 10000);
+    ds_.stops_within_radius({x, y}, random(0, 500));
+}
+
 MainProgram::CmdResult MainProgram::cmd_region_bounding_box(std::ostream& output, MainProgram::MatchIter begin, MainProgram::MatchIter end)
 {
     string regionidstr = *begin++;
@@ -1012,6 +1060,93 @@ MainProgram::CmdResult MainProgram::cmd_clear_all(std::ostream& output, MatchIte
     return {};
 }
 
+MainProgram::CmdResult MainProgram::cmd_memory_usage(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    assert(begin == end && "Invalid number of parameters");
+
+    unsigned long int total = 0;
+    for (auto& part : ds_.memory_usage())
+    {
+        output << part.first << ": " << part.second << " bytes" << endl;
+        total += part.second;
+    }
+    output << "Total: " << total << " bytes" << endl;
+
+    auto resident = process_memory("VmRSS");
+    auto peak = process_memory("VmHWM");
+    if (peak != 0)
+    {
+        output << "Process resident: " << resident << " kB, peak: " << peak << " kB" << endl;
+    }
+
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_save_snapshot(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string filename = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    if (ds_.save_snapshot(filename))
+    {
+        output << "Saved snapshot to '" << filename << "'" << endl;
+    }
+    else
+    {
+        output << "Cannot write file '" << filename << "'!" << endl;
+    }
+
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_load_snapshot(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string filename = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    // Loading replaces all the data, like clear_all
+    bool loaded = ds_.load_snapshot(filename);
+    init_primes();
+
+    if (loaded)
+    {
+        output << "Loaded snapshot from '" << filename << "': " << ds_.stop_count() << " stops, "
+               << ds_.all_regions().size() << " regions, " << ds_.all_routes().size() << " routes" << endl;
+    }
+    else
+    {
+        output << "Cannot load snapshot from '" << filename << "', cleared everything!" << endl;
+    }
+
+    view_dirty = true;
+
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_arena(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string on = *begin++;
+    string off = *begin++;
+    assert(begin == end && "Invalid number of parameters");
+
+    // Switching the allocator clears the data, like clear_all
+    ds_.set_arena(!on.empty());
+    init_primes();
+
+    if (!on.empty())
+    {
+        output << "Arena: on, cleared everything." << endl;
+    }
+    else if (!off.empty())
+    {
+        output << "Arena: off, cleared everything." << endl;
+    }
+
+    view_dirty = true;
+
+    return {};
+}
+
 std::string MainProgram::print_stop(StopID id, ostream& output)
 {
     if (id != NO_STOP)
@@ -1145,6 +1280,49 @@ void MainProgram::test_find_stops()
     }
 }
 
+MainProgram::CmdResult MainProgram::cmd_find_stops_prefix(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string prefix = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    auto result = ds_.find_stops_prefix(prefix);
+    if (result.empty()) { output << "No stops found." << endl; }
+
+    return {ResultType::STOPIDLIST, CmdResultStopIDs{NO_REGION, result}};
+}
+
+void MainProgram::test_find_stops_prefix()
+{
+    if (random_stops_added_ > 0) // Don't find if there's nothing to find
+    {
+        // Type-ahead for the start of a random name
+        auto name = n_to_name(random<decltype(random_stops_added_)>(0, random_stops_added_));
+        ds_.find_stops_prefix(name.substr(0, random<string::size_type>(3, name.size()+1)));
+    }
+}
+
+MainProgram::CmdResult MainProgram::cmd_find_stops_substring(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string part = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    auto result = ds_.find_stops_substring(part);
+    if (result.empty()) { output << "No stops found." << endl; }
+
+    return {ResultType::STOPIDLIST, CmdResultStopIDs{NO_REGION, result}};
+}
+
+void MainProgram::test_find_stops_substring()
+{
+    if (random_stops_added_ > 0) // Don't find if there's nothing to find
+    {
+        // Some part of a random name
+        auto name = n_to_name(random<decltype(random_stops_added_)>(0, random_stops_added_));
+        auto start = random<string::size_type>(0, name.size()-2);
+        ds_.find_stops_substring(name.substr(start, random<string::size_type>(3, 6)));
+    }
+}
+
 MainProgram::CmdResult MainProgram::cmd_journey_any(std::ostream& output, MainProgram::MatchIter begin, MainProgram::MatchIter end)
 {
     string fromidstr = *begin++;
@@ -1236,6 +1414,63 @@ void MainProgram::test_journey_shortest_distance()
     }
 }
 
+MainProgram::CmdResult MainProgram::cmd_journey_shortest_distance_astar(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string fromidstr = *begin++;
+    string toidstr = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    int fromid = convert_string_to<StopID>(fromidstr);
+    int toid = convert_string_to<StopID>(toidstr);
+
+    auto steps = ds_.journey_shortest_distance_astar(fromid, toid);
+
+    if (steps.empty())
+    {
+        output << "No journey found!" << endl;
+    }
+
+    vector<tuple<StopID, StopID, RouteID, Distance, Time>> result;
+
+    if (steps.empty())
+    {
+        output << "No journey found!" << endl;
+    }
+    else
+    {
+        auto [stop, route, dist] = steps.front();
+        for (auto iter = steps.begin()+1; iter != steps.end(); ++iter)
+        {
+            auto& [nstop, nroute, ndist] = *iter;
+            result.emplace_back(stop, nstop, route, dist, NO_TIME);
+            stop = nstop; route = nroute; dist = ndist;
+        }
+        result.emplace_back(stop, NO_STOP, route, dist, NO_TIME);
+    }
+
+    return {ResultType::JOURNEY, result};
+}
+
+void MainProgram::test_journey_shortest_distance_astar()
+{
+    if (random_stops_added_ > 0)
+    {
+     // Choose two random towns
+     auto id1 = n_to_id(random<decltype(random_stops_added_)>(0, random_stops_added_));
+     auto id2 = n_to_id(random<decltype(random_stops_added_)>(0, random_stops_added_));
+     ds_.journey_shortest_distance_astar(id1, id2);
+    }
+}
+
+MainProgram::CmdResult MainProgram::cmd_stops_settled(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    assert( begin == end && "Impossible number of parameters!");
+
+    output << "Stops settled in the last search: " << ds_.stops_settled() << endl;
+
+    return {};
+}
+
 MainProgram::CmdResult MainProgram::cmd_journey_least_stops(std::ostream& output, MainProgram::MatchIter begin, MainProgram::MatchIter end)
 {
     string fromidstr = *begin++;
@@ -1443,14 +1678,26 @@ MainProgram::CmdResult MainProgram::cmd_journey_earliest_arrival(std::ostream& o
     return {ResultType::JOURNEY, result};
 }
 
-MainProgram::CmdResult MainProgram::cmd_add_walking_connections(std::ostream &output, MainProgram::MatchIter /*begin*/, MainProgram::MatchIter /*end*/)
+MainProgram::CmdResult MainProgram::cmd_add_walking_connections(std::ostream &output, MainProgram::MatchIter begin, MainProgram::MatchIter end)
 {
+    string radiusstr = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    if (!radiusstr.empty())
+    {
+        ds_.set_walking_radius(convert_string_to<Distance>(radiusstr));
+    }
     ds_.add_walking_connections();
-    output << "Walking connections added.";
+    output << "Walking connections added." << endl;
 
     return {};
 }
 
+void MainProgram::test_add_walking_connections()
+{
+    ds_.add_walking_connections();
+}
+
 void MainProgram::test_journey_earliest_arrival()
 {
     if (random_stops_added_ > 0)
@@ -1463,6 +1710,57 @@ void MainProgram::test_journey_earliest_arrival()
     }
 }
 
+MainProgram::CmdResult MainProgram::cmd_journey_earliest_arrival_csa(std::ostream& output, MainProgram::MatchIter begin, MainProgram::MatchIter end)
+{
+    string fromidstr = *begin++;
+    string toidstr = *begin++;
+    string hourstr = *begin++;
+    string minstr = *begin++;
+    string secstr = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    int fromid = convert_string_to<StopID>(fromidstr);
+    int toid = convert_string_to<StopID>(toidstr);
+    int hour = convert_string_to<int>(hourstr);
+    int min = convert_string_to<int>(minstr);
+    int sec = convert_string_to<int>(secstr);
+    Time starttime = 3600*hour + 60*min + sec;
+
+    auto steps = ds_.journey_earliest_arrival_csa(fromid, toid, starttime);
+
+    vector<tuple<StopID, StopID, RouteID, Distance, Time>> result;
+
+    if (steps.empty())
+    {
+        output << "No journey found!" << endl;
+    }
+    else
+    {
+        auto [stop, route, time] = steps.front();
+        for (auto iter = steps.begin()+1; iter != steps.end(); ++iter)
+        {
+            auto& [nstop, nroute, ntime] = *iter;
+            result.emplace_back(stop, nstop, route, NO_DISTANCE, time);
+            stop = nstop; route = nroute; time = ntime;
+        }
+        result.emplace_back(stop, NO_STOP, route, NO_DISTANCE, time);
+    }
+
+    return {ResultType::JOURNEY, result};
+}
+
+void MainProgram::test_journey_earliest_arrival_csa()
+{
+    if (random_stops_added_ > 0)
+    {
+     // Choose two random towns
+     auto id1 = n_to_id(random<decltype(random_stops_added_)>(0, random_stops_added_));
+     auto id2 = n_to_id(random<decltype(random_stops_added_)>(0, random_stops_added_));
+     Time starttime = random<Time>(0, 3600*24);
+     ds_.journey_earliest_arrival_csa(id1, id2, starttime);
+    }
+}
+
 MainProgram::CmdResult MainProgram::cmd_clear_routes(std::ostream& output, MainProgram::MatchIter begin, MainProgram::MatchIter end)
 {
     assert( begin == end && "Impossible number of parameters!");
@@ -1497,14 +1795,22 @@ vector<MainProgram::CmdInfo> MainProgram::cmds_ =
     {"creation_finished", "", "", &MainProgram::cmd_creation_finished, nullptr },
     {"stop_count", "", "", &MainProgram::cmd_stop_count, nullptr },
     {"clear_all", "", "", &MainProgram::cmd_clear_all, nullptr },
+    {"arena", "on/off (one of these)", "(?:(on)|(off))", &MainProgram::cmd_arena, nullptr },
+    {"memory_usage", "", "", &MainProgram::cmd_memory_usage, nullptr },
+    {"save_snapshot", "\"filename\"", "\"([-a-zA-Z0-9 ./:_]+)\"", &MainProgram::cmd_save_snapshot, nullptr },
+    {"load_snapshot", "\"filename\"", "\"([-a-zA-Z0-9 ./:_]+)\"", &MainProgram::cmd_load_snapshot, nullptr },
     {"stops_alphabetically", "", "", &MainProgram::NoParStopListCmd<&Datastructures::stops_alphabetically>, &MainProgram::NoParStopListTestCmd<&Datastructures::stops_alphabetically> },
     {"stops_coord_order", "", "", &MainProgram::NoParStopListCmd<&Datastructures::stops_coord_order>, &MainProgram::NoParStopListTestCmd<&Datastructures::stops_coord_order> },
     {"min_coord", "", "", &MainProgram::NoParStopCmd<&Datastructures::min_coord>, &MainProgram::NoParStopTestCmd<&Datastructures::min_coord> },
     {"max_coord", "", "", &MainProgram::NoParStopCmd<&Datastructures::max_coord>, &MainProgram::NoParStopTestCmd<&Datastructures::max_coord> },
     {"stops_closest_to", "ID", stpidx, &MainProgram::cmd_stops_closest_to, &MainProgram::test_stops_closest_to },
+    {"stops_nearest_k", "(x,y) k", coordx+wsx+numx, &MainProgram::cmd_stops_nearest_k, &MainProgram::test_stops_nearest_k },
+    {"stops_within_radius", "(x,y) radius", coordx+wsx+numx, &MainProgram::cmd_stops_within_radius, &MainProgram::test_stops_within_radius },
     {"stops_common_region", "ID1 ID2", stpidx+wsx+stpidx, &MainProgram::cmd_stops_common_region, &MainProgram::test_stops_common_region },
     {"remove_stop", "ID", stpidx, &MainProgram::cmd_remove_stop, &MainProgram::test_remove_stop },
     {"find_stops", "name", namex, &MainProgram::cmd_find_stops, &MainProgram::test_find_stops },
+    {"find_stops_prefix", "prefix", namex, &MainProgram::cmd_find_stops_prefix, &MainProgram::test_find_stops_prefix },
+    {"find_stops_substring", "part", namex, &MainProgram::cmd_find_stops_substring, &MainProgram::test_find_stops_substring },
     {"change_stop_name", "ID newname", stpidx+wsx+namex, &MainProgram::cmd_change_stop_name, &MainProgram::test_change_stop_name },
     {"change_stop_coord", "ID (x,y)", stpidx+wsx+coordx, &MainProgram::cmd_change_stop_coord, &MainProgram::test_change_stop_coord },
     {"add_stop_to_region", "StopID RegionID", stpidx+wsx+regidx, &MainProgram::cmd_add_stop_to_region, nullptr },
@@ -1520,11 +1826,15 @@ vector<MainProgram::CmdInfo> MainProgram::cmds_ =
     {"journey_any", "StopIDfrom StopIDto", stpidx+wsx+stpidx, &MainProgram::cmd_journey_any, &MainProgram::test_journey_any },
     {"journey_least_stops", "StopIDfrom StopIDto", stpidx+wsx+stpidx, &MainProgram::cmd_journey_least_stops, &MainProgram::test_journey_least_stops },
     {"journey_shortest_distance", "StopIDfrom StopIDto", stpidx+wsx+stpidx, &MainProgram::cmd_journey_shortest_distance, &MainProgram::test_journey_shortest_distance },
+    {"journey_shortest_distance_astar", "StopIDfrom StopIDto", stpidx+wsx+stpidx, &MainProgram::cmd_journey_shortest_distance_astar, &MainProgram::test_journey_shortest_distance_astar },
+    {"stops_settled", "", "", &MainProgram::cmd_stops_settled, nullptr },
     {"journey_with_cycle", "StopIDfrom", stpidx, &MainProgram::cmd_journey_with_cycle, &MainProgram::test_journey_with_cycle },
     {"journey_earliest_arrival", "StopIDfrom StopIDto StartTime", stpidx+wsx+stpidx+wsx+"([0-9][0-9]):([0-9][0-9]):([0-9][0-9])",
      &MainProgram::cmd_journey_earliest_arrival, &MainProgram::test_journey_earliest_arrival },
+    {"journey_earliest_arrival_csa", "StopIDfrom StopIDto StartTime", stpidx+wsx+stpidx+wsx+"([0-9][0-9]):([0-9][0-9]):([0-9][0-9])",
+     &MainProgram::cmd_journey_earliest_arrival_csa, &MainProgram::test_journey_earliest_arrival_csa },
     {"add_trip", "RouteID Time1 Time2...", routeidx+"((?:"+wsx+"[0-9][0-9]:[0-9][0-9]:[0-9][0-9])+)", &MainProgram::cmd_add_trip, nullptr},
-    {"add_walking_connections", "", "", &MainProgram::cmd_add_walking_connections, nullptr },
+    {"add_walking_connections", "[radius]", "(?:"+numx+")?", &MainProgram::cmd_add_walking_connections, &MainProgram::test_add_walking_connections },
     {"quit", "", "", nullptr, nullptr },
     {"help", "", "", &MainProgram::help_command, nullptr },
     {"read", "\"in-filename\"", "\"([-a-zA-Z0-9 ./:_]+)\"", &MainProgram::cmd_read, nullptr },
@@ -1553,9 +1863,10 @@ MainProgram::CmdResult MainProgram::cmd_perftest(std::ostream& output, MatchIter
     output << "WARNING: Debug STL enabled, performance will be worse than expected (maybe also asymptotically)!" << endl;
 #endif // _GLIBCXX_DEBUG
 
-    vector<string> optional_cmds({"region_bounding_box", "stops_closest_to", "stops_common_region", "journey_least_stops", "journey_with_cycle", "journey_shortest_distance",
-                                  "add_trip", "route_times_from", "journey_earliest_arrival", "add_walking_connections"});
-    vector<string> nondefault_cmds({"remove_stop", "find_stops", "route_stops", "route_times_from"});
+    vector<string> optional_cmds({"region_bounding_box", "stops_closest_to", "stops_nearest_k", "stops_within_radius", "stops_common_region", "journey_least_stops", "journey_with_cycle", "journey_shortest_distance",
+                                  "journey_shortest_distance_astar",
+                                  "add_trip", "route_times_from", "journey_earliest_arrival", "journey_earliest_arrival_csa", "add_walking_connections"});
+    vector<string> nondefault_cmds({"remove_stop", "find_stops", "find_stops_prefix", "find_stops_substring", "route_stops", "route_times_from"});
 
     string commandstr = *begin++;
     unsigned int timeout = convert_string_to<unsigned int>(*begin++);
@@ -1630,7 +1941,7 @@ MainProgram::CmdResult MainProgram::cmd_perftest(std::ostream& output, MatchIter
         return {};
     }
 
-    output << setw(7) << "N" << " , " << setw(12) << "add (sec)" << " , " << setw(12) << "cmds (sec)"  << " , " << setw(12) << "total (sec)" << endl;
+    output << setw(7) << "N" << " , " << setw(12) << "add (sec)" << " , " << setw(12) << "cmds (sec)"  << " , " << setw(12) << "total (sec)" << " , " << setw(12) << "mem (MB)" << " , " << setw(12) << "peak (MB)" << endl;
     flush_output(output);
 
     auto stop = false;
@@ -1741,14 +2052,12 @@ MainProgram::CmdResult MainProgram::cmd_perftest(std::ostream& output, MatchIter
         auto totalsec = stopwatch.elapsed();
         output << setw(12) << totalsec-addsec << " , " << setw(12) << totalsec;
 
-//        unsigned long int maxmem;
-//        string unit;
-//        tie(maxmem, unit) = mempeak();
-//        maxmem -=  startmem;
-//        if (maxmem != 0)
-//        {
-//            output << ", memory " << maxmem << " " << unit;
-//        }
+
+        unsigned long int membytes = 0;
+        for (auto& part : ds_.memory_usage()) { membytes += part.second; }
+        output << " , " << setw(12) << membytes / (1024.0*1024.0);
+        // The peak resident size of the whole process so far, so it never goes down between the N
+        output << " , " << setw(12) << process_memory("VmHWM") / 1024.0;
         output << endl;
         flush_output(output);
     }
@@ -2027,6 +2336,23 @@ bool MainProgram::check_stop() const
     return false;
 }
 
+unsigned long int MainProgram::process_memory(std::string const& field)
+{
+    // Only Linux has /proc/self/status, elsewhere the file doesn't open
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line))
+    {
+        if (line.compare(0, field.size()+1, field+":") == 0)
+        {
+            unsigned long int kb = 0;
+            istringstream(line.substr(field.size()+1)) >> kb;
+            return kb;
+        }
+    }
+    return 0;
+}
+
 std::array<unsigned long int, 20> const MainProgram::primes1{4943,   4951,   4957,   4967,   4969,   4973,   4987,   4993,   4999,   5003,
                                                              5009,   5011,   5021,   5023,   5039,   5051,   5059,   5077,   5081,   5087};
 std::array<unsigned long int, 20> const MainProgram::primes2{81031,  81041,  81043,  81047,  81049,  81071,  81077,  81083,  81097,  81101,
@@ -2036,8 +2362,6 @@ MainProgram::MainProgram()
 {
     rand_engine_.seed(time(nullptr));
 
-    //    startmem = get<0>(mempeak());
-
     init_primes();
     init_regexs();
 }
@@ -66,6 +66,9 @@ private:
     std::string n_to_routeid(unsigned long int n);
     StopID n_to_id(unsigned long int n);
 
+    // A memory figure of the process in kB from /proc/self/status (e.g. "VmHWM"), 0 if not available
+    static unsigned long int process_memory(std::string const& field);
+
 
     enum class StopwatchMode { OFF, ON, NEXT };
     StopwatchMode stopwatch_mode = StopwatchMode::OFF;
@@ -103,6 +106,10 @@ private:
     CmdResult help_command(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_stop_count(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_clear_all(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_arena(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_memory_usage(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_save_snapshot(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_load_snapshot(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_all_stops(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_add_stop(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_stop_name(std::ostream& output, MatchIter begin, MatchIter end);
@@ -111,6 +118,8 @@ private:
     CmdResult cmd_region_name(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_creation_finished(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_find_stops(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_find_stops_prefix(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_find_stops_substring(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_change_stop_name(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_change_stop_coord(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_all_regions(std::ostream& output, MatchIter begin, MatchIter end);
@@ -118,6 +127,8 @@ private:
     CmdResult cmd_add_subregion_to_region(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_stop_regions(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_stops_closest_to(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_stops_nearest_k(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_stops_within_radius(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_region_bounding_box(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_stops_common_region(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_all_routes(std::ostream& output, MatchIter begin, MatchIter end);
@@ -129,10 +140,13 @@ private:
     CmdResult cmd_journey_any(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_journey_least_stops(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_journey_shortest_distance(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_journey_shortest_distance_astar(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_stops_settled(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_journey_with_cycle(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_route_times_from(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_add_trip(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_journey_earliest_arrival(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_journey_earliest_arrival_csa(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_add_walking_connections(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_random_add(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_random_route_trips(std::ostream& output, MatchIter begin, MatchIter end);
@@ -147,11 +161,15 @@ private:
     void test_stop_name();
     void test_stop_coord();
     void test_find_stops();
+    void test_find_stops_prefix();
+    void test_find_stops_substring();
     void test_change_stop_name();
     void test_change_stop_coord();
     void test_region_name();
     void test_stop_regions();
     void test_stops_closest_to();
+    void test_stops_nearest_k();
+    void test_stops_within_radius();
     void test_remove_stop();
     void test_region_bounding_box();
     void test_stops_common_region();
@@ -160,8 +178,11 @@ private:
     void test_journey_any();
     void test_journey_least_stops();
     void test_journey_shortest_distance();
+    void test_journey_shortest_distance_astar();
     void test_journey_with_cycle();
     void test_journey_earliest_arrival();
+    void test_journey_earliest_arrival_csa();
+    void test_add_walking_connections();
     void test_random_route_trips();
 
     void add_random_stops_regions(unsigned int size, Coord min = {1,1}, Coord max = {10000, 10000});
@@ -181,13 +202,13 @@ private:
     template<StopID(Datastructures::*MFUNC)()>
     CmdResult NoParStopCmd(std::ostream& output, MatchIter begin, MatchIter end);
 
-    template<std::vector<StopID>(Datastructures::*MFUNC)()>
+    template<auto MFUNC>
     CmdResult NoParStopListCmd(std::ostream& output, MatchIter begin, MatchIter end);
 
     template<StopID(Datastructures::*MFUNC)()>
     void NoParStopTestCmd();
 
-    template<std::vector<StopID>(Datastructures::*MFUNC)()>
+    template<auto MFUNC>
     void NoParStopListTestCmd();
 
     friend class MainWindow;
@@ -236,10 +257,10 @@ MainProgram::CmdResult MainProgram::NoParStopCmd(std::ostream& /*output*/, Match
     return {ResultType::STOPIDLIST, MainProgram::CmdResultStopIDs{NO_REGION, {result}}};
 }
 
-template<std::vector<StopID>(Datastructures::*MFUNC)()>
+template<auto MFUNC>
 MainProgram::CmdResult MainProgram::NoParStopListCmd(std::ostream& output, MatchIter /*begin*/, MatchIter /*end*/)
 {
-    auto result = (ds_.*MFUNC)();
+    std::vector<StopID> result = (ds_.*MFUNC)();
     if (result.empty())
     {
         output << "No stops!" << std::endl;
@@ -253,7 +274,7 @@ void MainProgram::NoParStopTestCmd()
     (ds_.*MFUNC)();
 }
 
-template<std::vector<StopID>(Datastructures::*MFUNC)()>
+template<auto MFUNC>
 void MainProgram::NoParStopListTestCmd()
 {
     (ds_.*MFUNC)();